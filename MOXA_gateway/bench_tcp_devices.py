@@ -0,0 +1,105 @@
+import asyncio
+import json
+import os
+import socket
+import struct
+import sys
+import time
+
+# Polling benchmark: RTU server polling many Modbus TCP devices from its TCP engine thread
+# usage: python3 bench_tcp_devices.py setup [devices] [scan_ms]
+#          adds devices 1..devices (127.0.0.1, BASE_PORT + id) with two poll blocks each to
+#          modbus_mapping.db of the current directory; start modbus_rtu_server after it
+#        python3 bench_tcp_devices.py run [devices] [seconds] [rtu_server_pid]
+#          simulates the devices, counts the reads they answer each second; reports missed_polls of
+#          modbus_stats:rtu and the CPU time of the RTU server (pid of modbus_rtu_server)
+
+HOST = '127.0.0.1'
+BASE_PORT = 15000
+REDIS_PORT = 6379
+BLOCK_ADDRESSES = (0, 1000)  # more than 125 registers apart: not merged into one read
+BLOCK_QUANTITY = 10
+
+command = sys.argv[1] if len(sys.argv) > 1 else 'run'
+devices = int(sys.argv[2]) if len(sys.argv) > 2 else 150
+reads = 0
+
+
+def setup(scan_ms):
+    from database_service import init_db, add_device, add_tcp_route, add_poll_tag
+    if devices > 247:
+        sys.exit("at most 247 devices, one RTU ID each")
+    init_db()
+    for device_id in range(1, devices + 1):
+        add_device(device_id, None, HOST, BASE_PORT + device_id, "bench {}".format(device_id), '', 'bench')
+        add_tcp_route(device_id, device_id, 1)
+        for i, address in enumerate(BLOCK_ADDRESSES):
+            add_poll_tag(100000 + device_id * 10 + i, device_id, 3, address, BLOCK_QUANTITY, scan_ms, 'bench')
+    print("[Bench] {} devices, {} blocks every {} ms -> {:.0f} reads/s expected".format(
+        devices, devices * len(BLOCK_ADDRESSES), scan_ms, devices * len(BLOCK_ADDRESSES) * 1000 / scan_ms))
+
+
+async def handle(reader, writer):
+    global reads
+    try:
+        while True:
+            tid, _, length, unit = struct.unpack('>HHHB', await reader.readexactly(7))
+            function, address, quantity = struct.unpack('>BHH', (await reader.readexactly(length - 1))[:5])
+            if function in (3, 4):
+                pdu = bytes([function, 2 * quantity]) + struct.pack('>{}H'.format(quantity), *range(quantity))
+                reads += 1
+            else:
+                pdu = bytes([function | 0x80, 1])
+            writer.write(struct.pack('>HHHB', tid, 0, len(pdu) + 1, unit) + pdu)
+    except (asyncio.IncompleteReadError, ConnectionError, asyncio.CancelledError):
+        writer.close()
+
+
+def missed_polls():
+    """Sum of missed_polls of all TCP devices in modbus_stats:rtu, None without Redis"""
+    try:
+        sock = socket.create_connection((HOST, REDIS_PORT), timeout=1)
+        sock.sendall(b'*2\r\n$3\r\nGET\r\n$16\r\nmodbus_stats:rtu\r\n')
+        reply = sock.makefile('rb')
+        header = reply.readline()  # $<length>, $-1 if key missing
+        stats = json.loads(reply.read(int(header[1:]))) if header.startswith(b'$') and int(header[1:]) > 0 else {}
+        sock.close()
+        return sum(device.get('missed_polls', 0) for device in stats.get('tcp_devices', []))
+    except (OSError, ValueError):
+        return None
+
+
+def cpu_seconds(pid):
+    with open('/proc/{}/stat'.format(pid)) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')  # utime + stime
+
+
+async def run(seconds, pid):
+    global reads
+    servers = [await asyncio.start_server(handle, HOST, BASE_PORT + device_id) for device_id in range(1, devices + 1)]
+    print("[Bench] {} devices listening on ports {}..{}".format(devices, BASE_PORT + 1, BASE_PORT + devices))
+    await asyncio.sleep(5)  # connect, load poll plans
+    missed_start = missed_polls()
+    cpu_start = cpu_seconds(pid) if pid else 0
+    start = time.time()
+    reads = 0
+    for second in range(seconds):
+        await asyncio.sleep(1)
+        print("[Bench] {:3d} s: {:6d} reads".format(second + 1, reads))
+    elapsed = time.time() - start
+    missed_end = missed_polls()
+    line = "[Bench] {:.0f} reads/s".format(reads / elapsed)
+    if missed_start is not None and missed_end is not None:
+        line += ", {} missed polls".format(missed_end - missed_start)  # stats are published every 5 s
+    if pid:
+        line += ", RTU server CPU {:.1f}% of one core".format((cpu_seconds(pid) - cpu_start) / elapsed * 100)
+    print(line)
+    for server in servers:
+        server.close()
+
+
+if command == 'setup':
+    setup(int(sys.argv[3]) if len(sys.argv) > 3 else 200)
+else:
+    asyncio.run(run(int(sys.argv[3]) if len(sys.argv) > 3 else 20, int(sys.argv[4]) if len(sys.argv) > 4 else 0))
@@ -0,0 +1,84 @@
+import socket
+import ssl
+import struct
+import sys
+import time
+
+# Throughput benchmark: plain Modbus TCP (PORT) against Modbus/TCP Security (TLS_PORT)
+# usage: python3 bench_tls.py [requests] [window] [address]
+#   requests: number of requests per run
+#   window:   requests sent before waiting for responses (pipelining)
+#   address:  tcp_address to read; use an address without mapping to measure only
+#             the gateway transport (gateway answers exception 0x02 itself)
+
+HOST = '127.0.0.1'
+PORT = 1502
+TLS_PORT = 1802
+RESPONSE_SIZE = 8
+
+requests = int(sys.argv[1]) if len(sys.argv) > 1 else 10000
+window = int(sys.argv[2]) if len(sys.argv) > 2 else 32
+address = int(sys.argv[3]) if len(sys.argv) > 3 else 65535
+rtu_id = 1
+function = 3
+quantity = 1
+
+
+def recv_exact(sock, size):
+    data = b''
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError("server closed connection")
+        data += chunk
+    return data
+
+
+def run(sock):
+    """Send requests with a window of outstanding requests, return (seconds, responses)"""
+    start = time.time()
+    sent = 0
+    received = 0
+    while received < requests:
+        batch = b''
+        while sent < requests and sent - received < window:
+            batch += struct.pack('!7H', sent & 0xFFFF, 0, 6, rtu_id, address, function, quantity)
+            sent += 1
+        if batch:
+            sock.sendall(batch)
+        recv_exact(sock, RESPONSE_SIZE)
+        received += 1
+    return time.time() - start, received
+
+
+def report(name, seconds, count, handshake_ms):
+    print("[Bench] {:<16} handshake {:7.2f} ms, {:6d} requests in {:6.3f} s -> {:9.0f} req/s, {:8.1f} kB/s".format(
+        name, handshake_ms, count, seconds, count / seconds, count * (14 + RESPONSE_SIZE) / seconds / 1024))
+
+
+# ----- plain TCP -----
+t = time.time()
+sock = socket.create_connection((HOST, PORT))
+sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+handshake_ms = (time.time() - t) * 1000
+seconds, count = run(sock)
+sock.close()
+report("plain", seconds, count, handshake_ms)
+
+# ----- TLS, full handshake then resumed session -----
+context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+context.check_hostname = False
+context.verify_mode = ssl.CERT_NONE  # self-signed test certificate
+session = None
+for name in ("tls", "tls resumed"):
+    t = time.time()
+    raw = socket.create_connection((HOST, TLS_PORT))
+    raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sock = context.wrap_socket(raw, session=session)
+    handshake_ms = (time.time() - t) * 1000
+    seconds, count = run(sock)
+    session = sock.session  # TLS 1.3 ticket arrives after handshake, take it after first response
+    if name == "tls resumed":
+        print("[Bench] session reused:", sock.session_reused)
+    sock.close()
+    report(name, seconds, count, handshake_ms)
@@ -1,5 +1,6 @@
 import sqlite3
 import logging
+import json
 
 # Cấu hình logging vào file
 logging.basicConfig(filename='database_service.log', level=logging.INFO,
@@ -29,12 +30,39 @@ def init_db():
     # datetime('now', 'localtime') -> Local time
     cursor.execute(''' CREATE TABLE IF NOT EXISTS info_devices
                    (id INTEGER PRIMARY KEY AUTOINCREMENT,
-                    update DATETIME DEFAULT datetime('now', 'localtime'),
+                    "update" DATETIME DEFAULT (datetime('now', 'localtime')),
                     ip_address TEXT,
                     tcp_port INTEGER,
                     device_name TEXT,
                     device_model TEXT,
                     device_type TEXT)''')
+
+    # device_info table: southbound Modbus TCP devices, read by RTU server (see rtu_route.device_id)
+    # connections: persistent connections to the device, max_pipeline: requests on the wire per connection
+    # port_id, unit_id, slave_id, response_ms: serial slave found by discovery scan (ip_address '', tcp_port 0)
+    # device_model: template of device_template, tcp_base_address: tcp address of template address 0
+    cursor.execute(''' CREATE TABLE IF NOT EXISTS device_info
+                   (id INTEGER PRIMARY KEY AUTOINCREMENT,
+                    "update" DATETIME DEFAULT CURRENT_TIMESTAMP,
+                    ip_address TEXT NOT NULL,
+                    tcp_port INTEGER NOT NULL,
+                    device_name TEXT,
+                    device_model TEXT,
+                    device_type TEXT,
+                    connections INTEGER DEFAULT 1,
+                    max_pipeline INTEGER DEFAULT 1,
+                    port_id INTEGER,
+                    unit_id INTEGER,
+                    slave_id TEXT,
+                    response_ms REAL,
+                    tcp_base_address INTEGER)''')
+    for column in ("connections INTEGER DEFAULT 1", "max_pipeline INTEGER DEFAULT 1",
+                   "port_id INTEGER", "unit_id INTEGER", "slave_id TEXT", "response_ms REAL",
+                   "tcp_base_address INTEGER"):
+        try:
+            cursor.execute("ALTER TABLE device_info ADD COLUMN " + column)
+        except sqlite3.OperationalError:
+            pass  # column exists
     
     # data table: tcp_address, tcp_port, function_code, start_address, quantity, description
     # contain data to read from Modbus TCP devices
@@ -44,17 +72,106 @@ def init_db():
                    function_code INTEGER,
                    start_address INTEGER,
                    quantity INTEGER,
-                   description TEXT)''')
+                   description TEXT,
+                   rtu_id INTEGER,
+                   scan_rate_ms INTEGER DEFAULT 1000,
+                   deadband REAL DEFAULT 0,
+                   deadband_percent INTEGER DEFAULT 0,
+                   max_silence_ms INTEGER DEFAULT 60000)''')
+
+    # get_data from older versions: add polling columns (RTU server polls rows with rtu_id)
+    # deadband: publish to modbus_data only if a register moved more than this (deadband_percent 1: in %)
+    # max_silence_ms: publish unchanged tag at least this often, 0 = only on change
+    for column in ("rtu_id INTEGER", "scan_rate_ms INTEGER DEFAULT 1000", "deadband REAL DEFAULT 0",
+                   "deadband_percent INTEGER DEFAULT 0", "max_silence_ms INTEGER DEFAULT 60000"):
+        try:
+            cursor.execute("ALTER TABLE get_data ADD COLUMN " + column)
+        except sqlite3.OperationalError:
+            pass  # column exists
+
+    # rate_limit table: rtu_id, max_rate (requests/s), burst (requests), cache_max_age (ms)
+    # slaves without a row are not limited
+    cursor.execute(''' CREATE TABLE IF NOT EXISTS rate_limit
+                   (rtu_id INTEGER PRIMARY KEY,
+                   max_rate REAL,
+                   burst INTEGER DEFAULT 1,
+                   cache_max_age INTEGER DEFAULT 5000)''')
+
+    # retry_policy table: rtu_id, retries (extra attempts), retry_gap_ms, retry_on ('crc', 'timeout' or 'crc,timeout')
+    # slaves without a row are not retried
+    cursor.execute(''' CREATE TABLE IF NOT EXISTS retry_policy
+                   (rtu_id INTEGER PRIMARY KEY,
+                   retries INTEGER DEFAULT 1,
+                   retry_gap_ms INTEGER DEFAULT 0,
+                   retry_on TEXT DEFAULT 'crc,timeout')''')
+
+    # device_profile table: what a slave accepts, learned by RTU server (manual = 0) or set by hand (manual = 1)
+    # unsupported_functions: '22,23', gap_reads: 0 if reads over registers between tags are refused
+    cursor.execute(''' CREATE TABLE IF NOT EXISTS device_profile
+                   (rtu_id INTEGER PRIMARY KEY,
+                   max_read_registers INTEGER,
+                   unsupported_functions TEXT,
+                   frame_gap_ms INTEGER,
+                   gap_reads INTEGER,
+                   manual INTEGER DEFAULT 0)''')
+
+    # device_template table: named tags of a device model, polled and mapped for devices with this model
+    # data_type: 'uint16', 'int16', 'uint32', 'int32' or 'float32' (32-bit: high word first, word_swap 1: low word first)
+    # value = registers as data_type * scale, deadband of the value
+    cursor.execute(''' CREATE TABLE IF NOT EXISTS device_template
+                   (model TEXT,
+                   name TEXT,
+                   function_code INTEGER DEFAULT 3,
+                   address INTEGER,
+                   data_type TEXT DEFAULT 'uint16',
+                   word_swap INTEGER DEFAULT 0,
+                   scale REAL DEFAULT 1,
+                   deadband REAL DEFAULT 0,
+                   unit TEXT,
+                   scan_rate_ms INTEGER DEFAULT 1000,
+                   PRIMARY KEY (model, name))''')
+
+    # device_template_block table: recommended block reads of a device model, tags inside are read by them
+    cursor.execute(''' CREATE TABLE IF NOT EXISTS device_template_block
+                   (model TEXT,
+                   function_code INTEGER DEFAULT 3,
+                   start_address INTEGER,
+                   quantity INTEGER,
+                   scan_rate_ms INTEGER DEFAULT 1000)''')
+
+    # serial_port table: one row per RS-485 port, each port has its own worker in RTU server
+    # parity: 'N', 'E' or 'O'
+    cursor.execute(''' CREATE TABLE IF NOT EXISTS serial_port
+                   (port_id INTEGER PRIMARY KEY,
+                   device TEXT,
+                   baudrate INTEGER DEFAULT 9600,
+                   parity TEXT DEFAULT 'N',
+                   data_bits INTEGER DEFAULT 8,
+                   stop_bits INTEGER DEFAULT 1)''')
+
+    # rtu_route table: serial port of each RTU ID (RTU IDs without route use the first port)
+    # rows with device_id: RTU ID is served by Modbus TCP device device_info.id with unit id unit_id
+    cursor.execute(''' CREATE TABLE IF NOT EXISTS rtu_route
+                   (rtu_id INTEGER PRIMARY KEY,
+                   port_id INTEGER,
+                   device_id INTEGER,
+                   unit_id INTEGER)''')
+    for column in ("device_id INTEGER", "unit_id INTEGER"):
+        try:
+            cursor.execute("ALTER TABLE rtu_route ADD COLUMN " + column)
+        except sqlite3.OperationalError:
+            pass  # column exists
     conn.commit()
     conn.close()
 
 #======================================================================================================
 #======================= Functinons for work with adding new devices ==================================
-def add_device(id, update, ip_address, tcp_port, device_name, device_model, device_type):
+def add_device(id, update, ip_address, tcp_port, device_name, device_model, device_type, connections=1, max_pipeline=1):
     conn = sqlite3.connect('modbus_mapping.db')
     cursor = conn.cursor()
-    cursor.execute("INSERT OR REPLACE INTO device_info VALUES (?, ?, ?, ?, ?, ?, ?)",
-                   (id, update, ip_address, tcp_port, device_name, device_model, device_type))
+    cursor.execute("INSERT OR REPLACE INTO device_info (id, \"update\", ip_address, tcp_port, device_name, device_model, device_type, "
+                   "connections, max_pipeline) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                   (id, update, ip_address, tcp_port, device_name, device_model, device_type, connections, max_pipeline))
     conn.commit()
     conn.close()
 
@@ -105,6 +222,171 @@ def delete_mapping(tcp_address):
     conn.commit()
     conn.close()
 
+#======================================================================================================
+#======================= Functions for rate limit per RTU ID ==========================================
+def add_rate_limit(rtu_id, max_rate, burst=1, cache_max_age=5000):
+    """Add or update request rate limit for one RTU ID"""
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("INSERT OR REPLACE INTO rate_limit VALUES (?, ?, ?, ?)",
+                   (rtu_id, max_rate, burst, cache_max_age))
+    conn.commit()
+    conn.close()
+    logging.info("Added rate limit: RTU ID {} -> {} req/s, burst {}".format(rtu_id, max_rate, burst))
+
+def delete_rate_limit(rtu_id):
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("DELETE FROM rate_limit WHERE rtu_id = ?", (rtu_id,))
+    conn.commit()
+    conn.close()
+
+def add_retry_policy(rtu_id, retries=1, retry_gap_ms=0, retry_on='crc,timeout'):
+    """Add or update retry policy for one RTU ID, retry_on: 'crc', 'timeout' or 'crc,timeout'"""
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("INSERT OR REPLACE INTO retry_policy VALUES (?, ?, ?, ?)",
+                   (rtu_id, retries, retry_gap_ms, retry_on))
+    conn.commit()
+    conn.close()
+    logging.info("Added retry policy: RTU ID {} -> {} retries on {}, gap {} ms".format(rtu_id, retries, retry_on, retry_gap_ms))
+
+def delete_retry_policy(rtu_id):
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("DELETE FROM retry_policy WHERE rtu_id = ?", (rtu_id,))
+    conn.commit()
+    conn.close()
+
+def set_device_profile(rtu_id, max_read_registers=125, unsupported_functions='', frame_gap_ms=0, gap_reads=1):
+    """Set profile of one RTU ID by hand, RTU server does not learn it any more"""
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("INSERT OR REPLACE INTO device_profile VALUES (?, ?, ?, ?, ?, 1)",
+                   (rtu_id, max_read_registers, unsupported_functions, frame_gap_ms, gap_reads))
+    conn.commit()
+    conn.close()
+    logging.info("Set device profile: RTU ID {} -> max read {}, unsupported functions [{}], frame gap {} ms, gap reads {}".format(
+        rtu_id, max_read_registers, unsupported_functions, frame_gap_ms, gap_reads))
+
+def delete_device_profile(rtu_id):
+    """Forget profile of one RTU ID, RTU server learns it again"""
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("DELETE FROM device_profile WHERE rtu_id = ?", (rtu_id,))
+    conn.commit()
+    conn.close()
+
+#======================================================================================================
+#======================= Functions for serial ports and RTU routing ===================================
+def add_serial_port(port_id, device, baudrate=9600, parity='N', data_bits=8, stop_bits=1):
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("INSERT OR REPLACE INTO serial_port VALUES (?, ?, ?, ?, ?, ?)",
+                   (port_id, device, baudrate, parity, data_bits, stop_bits))
+    conn.commit()
+    conn.close()
+    logging.info("Added serial port {}: {} {} {}{}{}".format(port_id, device, baudrate, data_bits, parity, stop_bits))
+
+def add_rtu_route(rtu_id, port_id):
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("INSERT OR REPLACE INTO rtu_route (rtu_id, port_id) VALUES (?, ?)", (rtu_id, port_id))
+    conn.commit()
+    conn.close()
+    logging.info("Added route: RTU ID {} -> port {}".format(rtu_id, port_id))
+
+def add_tcp_route(rtu_id, device_id, unit_id=None):
+    """Serve RTU ID by Modbus TCP device device_info.id (unit_id defaults to rtu_id)"""
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("INSERT OR REPLACE INTO rtu_route (rtu_id, device_id, unit_id) VALUES (?, ?, ?)",
+                   (rtu_id, device_id, unit_id if unit_id is not None else rtu_id))
+    conn.commit()
+    conn.close()
+    logging.info("Added route: RTU ID {} -> TCP device {} unit {}".format(rtu_id, device_id, unit_id))
+
+def delete_rtu_route(rtu_id):
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("DELETE FROM rtu_route WHERE rtu_id = ?", (rtu_id,))
+    conn.commit()
+    conn.close()
+
+#======================================================================================================
+#======================= Functions for polled tags (table get_data) ===================================
+def add_poll_tag(tcp_address, rtu_id, function_code, start_address, quantity, scan_rate_ms=1000, description='',
+                 deadband=0, deadband_percent=False, max_silence_ms=60000):
+    """Add or update a tag polled by RTU server every scan_rate_ms"""
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("INSERT OR REPLACE INTO get_data (tcp_address, function_code, start_address, quantity, description, rtu_id, scan_rate_ms, "
+                   "deadband, deadband_percent, max_silence_ms) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                   (tcp_address, function_code, start_address, quantity, description, rtu_id, scan_rate_ms,
+                    deadband, int(deadband_percent), max_silence_ms))
+    conn.commit()
+    conn.close()
+    logging.info("Added poll tag {}: RTU ID {} FC {} address {} x{} every {} ms".format(
+        tcp_address, rtu_id, function_code, start_address, quantity, scan_rate_ms))
+
+def delete_poll_tag(tcp_address):
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("DELETE FROM get_data WHERE tcp_address = ?", (tcp_address,))
+    conn.commit()
+    conn.close()
+
+#======================================================================================================
+#======================= Functions for device templates (device_template, device_template_block) ======
+def install_device_templates(path='device_templates.json'):
+    """Install device models of template library file, models in the file replace installed ones"""
+    with open(path) as f:
+        library = json.load(f)
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    for model, template in library.items():
+        cursor.execute("DELETE FROM device_template WHERE model = ?", (model,))
+        cursor.execute("DELETE FROM device_template_block WHERE model = ?", (model,))
+        for tag in template.get('tags', []):
+            cursor.execute("INSERT INTO device_template VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                           (model, tag['name'], tag.get('function_code', 3), tag['address'],
+                            tag.get('data_type', 'uint16'), int(tag.get('word_swap', False)), tag.get('scale', 1),
+                            tag.get('deadband', 0), tag.get('unit', ''), tag.get('scan_rate_ms', 1000)))
+        for block in template.get('blocks', []):
+            cursor.execute("INSERT INTO device_template_block VALUES (?, ?, ?, ?, ?)",
+                           (model, block.get('function_code', 3), block['start_address'], block['quantity'],
+                            block.get('scan_rate_ms', 1000)))
+        logging.info("Installed device template {}: {} tags, {} block reads".format(
+            model, len(template.get('tags', [])), len(template.get('blocks', []))))
+    conn.commit()
+    conn.close()
+
+def set_device_model(device_id, device_model, tcp_base_address=None):
+    """Poll and map device_info.id by template of device_model, tag address a -> tcp address tcp_base_address + a
+    A serial slave (port_id, unit_id) gets the rtu_route of unit_id to its port; ValueError if unit_id is
+    routed to another port or a TCP device"""
+    conn = sqlite3.connect('modbus_mapping.db')
+    cursor = conn.cursor()
+    cursor.execute("SELECT port_id, unit_id FROM device_info WHERE id = ?", (device_id,))
+    row = cursor.fetchone()
+    if row and row[0] is not None:
+        port_id, unit_id = row
+        cursor.execute("SELECT port_id, device_id FROM rtu_route WHERE rtu_id = ?", (unit_id,))
+        route = cursor.fetchone()
+        if route and (route[1] is not None or route[0] != port_id):
+            conn.close()
+            raise ValueError("RTU ID {} is routed to {}, device {} on port {} can not use it".format(
+                unit_id, "TCP device {}".format(route[1]) if route[1] is not None else "port {}".format(route[0]),
+                device_id, port_id))
+        if not route:
+            cursor.execute("INSERT INTO rtu_route (rtu_id, port_id) VALUES (?, ?)", (unit_id, port_id))
+            logging.info("Added route: RTU ID {} -> port {}".format(unit_id, port_id))
+    cursor.execute("UPDATE device_info SET device_model = ?, tcp_base_address = ? WHERE id = ?",
+                   (device_model, tcp_base_address, device_id))
+    conn.commit()
+    conn.close()
+    logging.info("Set device {} model {} at tcp address {}".format(device_id, device_model, tcp_base_address or 0))
+
 #======================================================================================================
 #======================================= Function for work with log fie ===============================
 def add_log(service, message):
@@ -8,7 +8,23 @@
 #include <jansson.h>
 #include <modbus/modbus.h>
 #include <errno.h>
+#include <limits.h>    // LLONG_MIN
 #include <sys/time.h>  // struct timeval
+#include <sys/epoll.h> // event-driven serial engine
+#include <sys/eventfd.h>
+#include <sys/timerfd.h> // us timeouts of serial engine
+#include <fcntl.h>
+#include <sys/socket.h> // southbound Modbus TCP
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/resource.h> // RLIMIT_NOFILE
+#include <termios.h>   // tcflush, VMIN/VTIME
+#include <sys/ioctl.h>
+#include <linux/serial.h> // ASYNC_LOW_LATENCY
+#include <time.h>      // clock_gettime
+#include <math.h>      // fabs
+#include <sqlite3.h>   // SQLite database
 #include "write_log.h" // include write_log function
 
 #define MAX_QUEUE 100
@@ -18,11 +34,84 @@
 #define BUFFER_SIZE 256
 
 #define USE_MODBUS 1 // 1 for RTU Modbus, 0 for TCP Modbus
-#define SERIAL_PORT "/dev/ttyUSB0"
+#define SERIAL_PORT "/dev/ttyUSB0" // default port if table serial_port is empty
 #define BAUDRATE 9600
 #define PARITY 'N'
 #define DATA_BITS 8
 #define STOP_BITS 1
+#define MAX_PORTS 8 // RS-485 ports, each one has its own queue and worker thread
+#define SERIAL_ENGINE_EPOLL 0 // 1: drive all serial ports from one epoll thread instead of one thread per port
+#define SERIAL_LOW_LATENCY 1  // 1: ASYNC_LOW_LATENCY on serial ports, engine wakes once per response frame (VMIN)
+#define RESPONSE_TIMEOUT_MS 1000 // max wait for first byte of response (slave without history)
+#define BYTE_TIMEOUT_MS 500      // max gap between bytes of response
+#define TIMEOUT_FLOOR_MS 20      // min response timeout of a slave with known response times
+#define LATENCY_SAMPLES 64       // response times kept per slave for percentile
+#define LATENCY_MIN_SAMPLES 5    // responses needed before timeout adapts
+#define RTU_FRAME_SIZE 256       // max Modbus RTU frame
+#define MAX_READ_REGISTERS 125   // quantity limits of one read (Modbus spec)
+#define MAX_WRITE_REGISTERS 123  // FC16
+#define MAX_WRITE_READ_REGISTERS 121 // write part of FC23
+#define REGISTER_BUFFERS 16      // per serial port: read results waiting in the response queue
+#define MAX_TCP_DEVICES 256      // southbound Modbus TCP devices (device_info)
+#define TCP_CONNECTIONS_MAX 4    // connection pool size per device
+#define TCP_PIPELINE_MAX 16      // outstanding requests per connection
+#define TCP_CONNECT_TIMEOUT_MS 2000
+#define TCP_RESPONSE_TIMEOUT_MS 1000
+#define TCP_FRAME_SIZE 260       // MBAP header + max PDU
+#define RTU_CHUNK_GAP_US 20000   // bytes of one frame reach userspace in chunks up to this far apart (UART FIFO, USB 16 ms)
+
+#define MAX_SLAVES 248           // rtu_id 0..247
+#define CACHE_SIZE 4096          // number of cached values (power of 2), also holds polled registers
+#define CACHE_MAX_AGE_MS 5000    // default age limit for answering from cache
+#define RATE_LIMIT_RELOAD_S 30   // reload rate_limit, retry_policy and device_profile tables every 30s
+
+#define PORT_RETRY_MIN_MS 50     // first delay before reopening a faulty serial port (first retry is at once)
+#define PORT_RETRY_MAX_MS 2000   // max delay between reopen attempts
+
+#define BREAKER_FAILURES 3            // timeouts in a row that open the circuit breaker of a slave
+#define BREAKER_BACKOFF_MS 1000       // first probe after breaker opened
+#define BREAKER_BACKOFF_MAX_MS 60000  // max wait between probes
+#define PROBE_TRANSACTION_ID -1       // internal request, no response to TCP server
+#define POLL_TRANSACTION_ID -2        // poll of get_data tag, result goes to value cache
+#define DISCOVERY_TRANSACTION_ID -3   // probe of slave discovery scan
+#define POLL_SCAN_MS 1000             // scan rate of tag without scan_rate_ms
+#define POLL_MIN_SCAN_MS 50
+#define CLIENT_TIMEOUT_MS 5000        // deadline of client request without timeout_ms
+#define POLL_CONFIG_CHECK_MS 2000     // check get_data for changes
+#define PLAN_TURNAROUND_MS 10         // slave response time for cost model until measured
+#define PLAN_TURNAROUND_DRIFT 0.25    // compile poll plans again when a measured response time moves 25%
+#define PLAN_TURNAROUND_DRIFT_MS 2    // ... and at least 2 ms
+#define STATS_INTERVAL_S 5            // publish stats to Redis key modbus_stats:rtu
+#define DATA_LOG_SIZE 16384           // buffered samples for table data_log, more are dropped
+#define DATA_LOG_BATCH 2000           // flush data_log when this many samples are buffered
+#define DATA_LOG_FLUSH_MS 1000        // or when the oldest buffered sample is this old
+#define DATA_LOG_ROWS 100             // rows per INSERT statement (4 parameters per row)
+#define TAG_UPDATE_SIZE 1024          // changed tags waiting for Redis channel modbus_data
+#define TAG_MAX_SILENCE_MS 60000      // default heartbeat of tag without change
+
+// status of response = Modbus exception code for TCP client, 0 if ok
+#define EXCEPTION_ILLEGAL_FUNCTION 0x01
+#define EXCEPTION_ILLEGAL_DATA_ADDRESS 0x02
+#define EXCEPTION_ILLEGAL_DATA_VALUE 0x03
+#define EXCEPTION_SERVER_BUSY 0x06
+#define EXCEPTION_TARGET_NO_RESPONSE 0x0B
+
+//====================================================================================================
+//========================= Function: monotonic time in ms ===========================================
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//========================= Function: monotonic time in us ============================================
+long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 //=============================================================================================================================
 //========================= structure for request packet receive from TCP server ==============================================
@@ -35,51 +124,179 @@ typedef struct
     int address;
     int function;
     int quantity;
+    long long deadline_ms; // drop request if not sent before (now_ms clock)
+    int poll_block;        // poll: index of block in plan_version of the port
+    int plan_version;
+    int attempt;           // retries already sent (table retry_policy)
+    long long not_before_ms; // retry: earliest start, bus is free for other requests until then
+    int write_address;     // FC6 / FC16 / FC23: first register written
+    int write_quantity;    // registers in write_value, 0 for reads and FC22
+    uint16_t write_value[MAX_WRITE_REGISTERS];
+    int and_mask;          // FC22
+    int or_mask;
+    int write_function;    // FC23 merged by scheduler from a write (6 or 16) and a read: function of the write
+    int read_transaction_id; // merged FC23: transaction_id of the read, transaction_id is the write
+    int discovery_port;    // discovery probe: index of the scanning port in serial_ports
+    int read_gaps;         // poll: block reads registers between its tags
+    int split_offset;      // part of a split read: offset of first register in the client read
+    int split_quantity;    // part of a split read: quantity of the client read, 0 if not split
 } RequestPacket;
 
-RequestPacket request_queue[MAX_QUEUE];
+//========================= request queue, one per serial port =======================================
+typedef struct
+{
+    RequestPacket items[MAX_QUEUE];
+    int front;
+    int rear;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int wake_fd; // eventfd of serial engine, -1 when a worker thread waits on cond
+} RequestQueue;
 
-int queue_front = 0;
-int queue_rear = 0;
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+void init_queue(RequestQueue *queue)
+{
+    queue->front = 0;
+    queue->rear = 0;
+    queue->wake_fd = -1;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+}
 
 //====================================================================================================
 //========================= Function: add request to queue ===================
-void add_request(RequestPacket add_req)
+// return 0 if added, -1 if queue is full
+int add_request(RequestQueue *queue, RequestPacket add_req)
+{
+    pthread_mutex_lock(&queue->mutex);
+    if ((queue->rear + 1) % MAX_QUEUE == queue->front)
+    {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+    queue->items[queue->rear] = add_req;
+    queue->rear = (queue->rear + 1) % MAX_QUEUE;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    if (queue->wake_fd >= 0)
+    {
+        uint64_t one = 1;
+        if (write(queue->wake_fd, &one, sizeof(one)) < 0)
+        {
+            perror("[RTU Server queue] wake serial engine");
+        }
+    }
+    return 0;
+}
+
+//========================= Function: wake worker of queue for work that is not in the queue =========
+void wake_queue(RequestQueue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    if (queue->wake_fd >= 0)
+    {
+        uint64_t one = 1;
+        if (write(queue->wake_fd, &one, sizeof(one)) < 0)
+        {
+            perror("[RTU Server queue] wake serial engine");
+        }
+    }
+}
+
+//========================= Function: number of requests in queue ====================================
+int queue_length(RequestQueue *queue)
 {
-    pthread_mutex_lock(&queue_mutex);
-    request_queue[queue_rear] = add_req;
-    queue_rear = (queue_rear + 1) % MAX_QUEUE;
-    pthread_cond_signal(&queue_cond);
-    pthread_mutex_unlock(&queue_mutex);
+    pthread_mutex_lock(&queue->mutex);
+    int length = (queue->rear - queue->front + MAX_QUEUE) % MAX_QUEUE;
+    pthread_mutex_unlock(&queue->mutex);
+    return length;
 }
 
 //====================================================================================================
-//========================= Function: take request from queue ========================================
-RequestPacket take_request()
+//========================= Function: take request from queue without waiting =======================
+// return 1 if a request was taken, 0 if queue is empty
+int try_take_request(RequestQueue *queue, RequestPacket *out)
 {
-    pthread_mutex_lock(&queue_mutex);
-    while (queue_front == queue_rear)
+    int taken = 0;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->front != queue->rear)
     {
-        pthread_cond_wait(&queue_cond, &queue_mutex);
+        *out = queue->items[queue->front];
+        queue->front = (queue->front + 1) % MAX_QUEUE;
+        taken = 1;
     }
-    RequestPacket take_request = request_queue[queue_front];
-    queue_front = (queue_front + 1) % MAX_QUEUE;
-    pthread_mutex_unlock(&queue_mutex);
-    return take_request;
+    pthread_mutex_unlock(&queue->mutex);
+    return taken;
+}
+
+//======================================================================================================
+//========================= register buffers: read results, one pool per serial port ==================
+//  the serial worker reads into a buffer and hands it to the response thread, which releases it
+typedef struct RegisterBuffer
+{
+    uint16_t value[MAX_READ_REGISTERS];
+    struct RegisterPool *pool;
+    struct RegisterBuffer *next; // free list
+} RegisterBuffer;
+
+typedef struct RegisterPool
+{
+    RegisterBuffer buffers[REGISTER_BUFFERS];
+    RegisterBuffer *free;
+    pthread_mutex_t mutex;
+} RegisterPool;
+
+void init_pool(RegisterPool *pool)
+{
+    pool->free = NULL;
+    for (int i = 0; i < REGISTER_BUFFERS; i++)
+    {
+        pool->buffers[i].pool = pool;
+        pool->buffers[i].next = pool->free;
+        pool->free = &pool->buffers[i];
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+}
+
+//========================= Function: take free buffer, NULL if all wait for the response thread ======
+RegisterBuffer *buffer_take(RegisterPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    RegisterBuffer *buffer = pool->free;
+    if (buffer)
+    {
+        pool->free = buffer->next;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return buffer;
+}
+
+void buffer_release(RegisterBuffer *buffer)
+{
+    if (!buffer)
+    {
+        return;
+    }
+    RegisterPool *pool = buffer->pool;
+    pthread_mutex_lock(&pool->mutex);
+    buffer->next = pool->free;
+    pool->free = buffer;
+    pthread_mutex_unlock(&pool->mutex);
 }
 
 //======================================================================================================
 //========================= structure packet save response from Modbus device ===========================
 typedef struct
 {
-    uint8_t transaction_id;
+    int transaction_id; // 16-bit transaction id assigned by TCP server
     uint8_t rtu_id;
     int address;
     int function;
     int status;
-    int value;
+    int value;              // first register
+    RegisterBuffer *buffer; // all registers read, NULL for exceptions and cached values
+    int quantity;           // registers in buffer
 } ResponsePacket;
 ResponsePacket response_queue[MAX_QUEUE];
 
@@ -93,6 +310,13 @@ pthread_cond_t resp_cond = PTHREAD_COND_INITIALIZER;
 void add_response(ResponsePacket add_res)
 {
     pthread_mutex_lock(&resp_mutex);
+    if ((resp_rear + 1) % MAX_QUEUE == resp_front)
+    {
+        pthread_mutex_unlock(&resp_mutex);
+        printf("[RTU Server] Response queue full, transaction_id %d dropped !!!\n", add_res.transaction_id);
+        buffer_release(add_res.buffer);
+        return;
+    }
     response_queue[resp_rear] = add_res;
     resp_rear = (resp_rear + 1) % MAX_QUEUE;
     pthread_cond_signal(&resp_cond);
@@ -115,188 +339,4292 @@ ResponsePacket take_response()
 }
 
 //====================================================================================================
-//======================== Thread 1: receive packet from TCP Server ==================================
-void *receive_request_thread(void *arg)
+//========================= Function: wait until queue has a request or deadline_ms passed ===========
+void wait_request(RequestQueue *queue, long long deadline_ms)
 {
-    sqlite3 *db;
-    sqlite3_open("modbus_mapping.db", &db);
-    redisContext *redis = redisConnect("127.0.0.1", 6379);
-    redisReply *reply = redisCommand(redis, "SUBSCRIBE modbus_request");
-
-    if (redis == NULL || redis->err)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts); // pthread_cond_timedwait uses realtime clock
+    long long wait_ms = deadline_ms - now_ms();
+    if (wait_ms < 0)
     {
-        fprintf(stderr, "[RTU Server connect Redis] Connection error: %s\n", redis->errstr);
-        return NULL;
+        wait_ms = 0;
     }
-    else
+    ts.tv_sec += wait_ms / 1000;
+    ts.tv_nsec += (wait_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000)
     {
-        printf("\n");
-        printf("[RTU Server connect Redis] Connected to Redis server\n");
-        // write_log_log("write_log.log", "INFO", "[RTU Server connect Redis] Connected to Redis server");
-        // write_log_db(db, "INFO", "Connected to Redis server");
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
     }
-    freeReplyObject(reply);
 
-    printf("[RTU Server connect Redis] Subscribed to modbus_request\n");
-    // write_log_log("write_log.log", "INFO", "[RTU Server connect Redis] Subscribed to modbus_request");
-    // write_log_db(db, "INFO", "Subscribed to modbus_request");
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->front == queue->rear)
+    {
+        if (pthread_cond_timedwait(&queue->cond, &queue->mutex, &ts) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
 
-    while (1)
+//====================================================================================================
+//========================= Serial ports and routing table ===========================================
+//  serial_port(port_id, device, baudrate, parity, data_bits, stop_bits)
+//  rtu_route(rtu_id, port_id)
+//  rtu_id without route -> first serial port
+#define TAG_NAME_SIZE 32
+
+typedef enum
+{
+    TAG_RAW, // registers of get_data tag, no type
+    TAG_UINT16,
+    TAG_INT16,
+    TAG_UINT32,
+    TAG_INT32,
+    TAG_FLOAT32
+} TagType;
+
+typedef struct
+{
+    int tag_id; // tcp_address of get_data, tcp address of template tag
+    int rtu_id;
+    int function;
+    int address;
+    int quantity;
+    int scan_ms;
+    double deadband;      // publish when a register (typed tag: its value) moves more than this since last publish
+    int deadband_percent; // 1: deadband in % of last published value
+    int max_silence_ms;   // publish at least this often, 0 = only on change
+    char name[TAG_NAME_SIZE]; // template tag, empty for get_data
+    TagType type;
+    int word_swap;        // 32-bit types: low word first
+    double scale;         // typed value = registers as type * scale
+    int block_address;    // recommended block read of template containing the tag,
+    int block_quantity;   // 0: compile merges the tag like get_data tags
+} PollTag;
+
+typedef struct
+{
+    uint16_t value[125]; // last published
+    long long published_ms; // 0 = never
+} TagState;
+
+typedef struct
+{
+    int rtu_id;
+    int function;
+    int address;
+    int quantity; // <= 125, may include registers between tags
+    int scan_ms;
+    int tag_count;
+    long long next_ms; // next scan
+    int first_tag;     // tags of block: tags[first_tag .. first_tag + tag_count)
+    uint16_t *last;    // registers of last read, valid after first read
+    int valid;
+    long long heartbeat_ms; // earliest max_silence_ms of its tags
+    int gap_registers;      // registers read between tags
+    int fixed;              // recommended block read of a device template, read as it is
+} PollBlock;
+
+typedef struct
+{
+    PollTag *tags; // polled tags of slaves on a serial port or TCP device, sorted
+    int tag_count;
+    TagState *tag_state; // report by exception, same index as tags
+    PollBlock *blocks;   // block reads compiled from tags
+    int block_count;
+    int plan_version; // changes on each compile, stale poll results are not published
+    int data_version; // PRAGMA data_version of last load
+    int profile_version; // device profiles the plan was compiled with
+    int latency_version; // plan_latency_version the plan was compiled with
+} PollPlan;
+
+//========================= slave discovery scan of one serial port ==================================
+#define DISCOVERY_TIMEOUT_MS 100     // probe timeout until a slave on the port answered (+ frame time)
+#define DISCOVERY_TIMEOUT_MIN_MS 20  // then 3 x slowest answer, at least this
+#define DISCOVERY_ID_BYTES 16        // report slave id data kept per slave
+#define DISCOVERY_PROGRESS_MS 1000   // progress to Redis key modbus_discovery:rtu
+
+typedef enum
+{
+    DISCOVERY_IDLE,
+    DISCOVERY_RUNNING,
+    DISCOVERY_DONE, // all ids probed, results not in device_info yet
+    DISCOVERY_SAVED
+} DiscoveryState;
+
+typedef struct
+{
+    DiscoveryState state;
+    int first_id;
+    int last_id;
+    int next_id;      // next rtu_id to probe
+    int function;     // 17 report slave id, 3 / 4 read of one register
+    int address;
+    int initial_timeout_ms;
+    int timeout_ms;   // current probe timeout
+    double slowest_ms; // slowest answer of this scan
+    int inflight;     // probe on the wire
+    long long probe_ms; // start of probe on the wire
+    int probed;
+    int found_count;
+    uint8_t found[MAX_SLAVES];
+    float response_ms[MAX_SLAVES];
+    uint8_t slave_id[MAX_SLAVES][DISCOVERY_ID_BYTES]; // report slave id data
+    uint8_t slave_id_len[MAX_SLAVES];
+    long long started_ms;
+    long long finished_ms;
+} Discovery;
+pthread_mutex_t discovery_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct
+{
+    int port_id;
+    char device[64];
+    int baudrate;
+    char parity;
+    int data_bits;
+    int stop_bits;
+    RequestQueue queue;
+    RegisterPool pool; // buffers for read results
+    pthread_t thread;
+    RequestPacket pending[MAX_QUEUE]; // client requests taken from queue, sent earliest deadline first
+    int pending_count;
+    PollPlan plan; // polled tags of slaves on this port
+    long long sent_requests; // stats
+    long long sent_polls;
+    long long missed_requests; // deadline passed before request reached the wire
+    long long missed_polls;    // scan period passed without read
+    long long retries;         // failed reads sent again (table retry_policy)
+    long long merged_requests; // write + read sent as one FC23
+    Discovery discovery;       // slave scan, protected by discovery_mutex
+} SerialPort;
+SerialPort serial_ports[MAX_PORTS];
+int port_count = 0;
+int slave_port[MAX_SLAVES]; // index in serial_ports for each rtu_id
+
+void load_serial_ports(sqlite3 *db)
+{
+    const char *sql = "SELECT port_id, device, baudrate, parity, data_bits, stop_bits FROM serial_port ORDER BY port_id";
+    sqlite3_stmt *stmt;
+
+    port_count = 0;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK)
     {
-        //-------------------------------------------------------------------------------------------------
-        //                     JSON data format:
-        //                        "message"                    -> element[0] - type of message,
-        //                    "modbus_response"                -> element[1] - channel name,
-        // "{\"transaction_id\":1,\"status\":0,\"value\":123}" -> element[2] - main
-        //-------------------------------------------------------------------------------------------------
-        redisReply *msg;
-        if (redisGetReply(redis, (void **)&msg) == REDIS_OK && msg)
+        while (sqlite3_step(stmt) == SQLITE_ROW && port_count < MAX_PORTS)
+        {
+            SerialPort *port = &serial_ports[port_count++];
+            const char *device = (const char *)sqlite3_column_text(stmt, 1);
+            const char *parity = (const char *)sqlite3_column_text(stmt, 3);
+            port->port_id = sqlite3_column_int(stmt, 0);
+            snprintf(port->device, sizeof(port->device), "%s", device ? device : SERIAL_PORT);
+            port->baudrate = sqlite3_column_type(stmt, 2) == SQLITE_NULL ? BAUDRATE : sqlite3_column_int(stmt, 2);
+            port->parity = parity && parity[0] ? parity[0] : PARITY;
+            port->data_bits = sqlite3_column_type(stmt, 4) == SQLITE_NULL ? DATA_BITS : sqlite3_column_int(stmt, 4);
+            port->stop_bits = sqlite3_column_type(stmt, 5) == SQLITE_NULL ? STOP_BITS : sqlite3_column_int(stmt, 5);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (port_count == 0) // no serial_port table or no rows -> port from #define
+    {
+        SerialPort *port = &serial_ports[port_count++];
+        port->port_id = 0;
+        snprintf(port->device, sizeof(port->device), "%s", SERIAL_PORT);
+        port->baudrate = BAUDRATE;
+        port->parity = PARITY;
+        port->data_bits = DATA_BITS;
+        port->stop_bits = STOP_BITS;
+    }
+    for (int i = 0; i < port_count; i++)
+    {
+        init_queue(&serial_ports[i].queue);
+        init_pool(&serial_ports[i].pool);
+        serial_ports[i].pending_count = 0;
+        serial_ports[i].plan.data_version = -2; // load poll plan on first check
+        printf("[RTU Server port] Port %d: %s %d %d%c%d\n", serial_ports[i].port_id, serial_ports[i].device,
+               serial_ports[i].baudrate, serial_ports[i].data_bits, serial_ports[i].parity, serial_ports[i].stop_bits);
+    }
+
+    for (int rtu_id = 0; rtu_id < MAX_SLAVES; rtu_id++)
+    {
+        slave_port[rtu_id] = 0;
+    }
+    sql = "SELECT rtu_id, port_id FROM rtu_route";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK)
+    {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
         {
-            if (msg->type == REDIS_REPLY_ARRAY && msg->elements == 3)
+            int rtu_id = sqlite3_column_int(stmt, 0);
+            int port_id = sqlite3_column_int(stmt, 1);
+            for (int i = 0; i < port_count && rtu_id >= 0 && rtu_id < MAX_SLAVES; i++)
             {
-                const char *json_str = msg->element[2]->str;
-                json_error_t error;
-                json_t *root = json_loads(json_str, 0, &error);
-                if (!root)
+                if (serial_ports[i].port_id == port_id)
                 {
-                    fprintf(stderr, "[RTU Server receive request] JSON parse error: %s\n", error.text);
-                    // write_log_log("write_log.log", "ERROR", "[RTU Server receive request] JSON parse error: %s !!!", error.text);
-                    // write_log_db(db, "ERROR", "JSON parse error: %s", error.text);
-                    freeReplyObject(msg);
-                    continue;
+                    slave_port[rtu_id] = i;
                 }
-                RequestPacket req;
-                // json packet
-                req.transaction_id = json_integer_value(json_object_get(root, "transaction_id"));
-                req.rtu_id = json_integer_value(json_object_get(root, "rtu_id"));
-                req.address = json_integer_value(json_object_get(root, "rtu_address"));
-                req.function = json_integer_value(json_object_get(root, "function"));
-                req.quantity = json_integer_value(json_object_get(root, "quantity"));
-                add_request(req);
-                json_decref(root); // clean up JSON object
-
-                printf("[RTU Server receive request] Received transaction_id %d, added to queue\n", req.transaction_id);
-                // write_log_db(db, "INFO", "Received transaction_id %d, added to queue", req.transaction_id);
-                // write_log_log("write_log.log", "INFO", "[RTU Server receive request] Received transaction_id %d, added to queue", req.transaction_id);
             }
-            freeReplyObject(msg);
         }
+        sqlite3_finalize(stmt);
     }
-    redisFree(redis); // clean up Redis connection
+}
 
-    return NULL;
+//========================= Function: serial port of rtu_id ==========================================
+SerialPort *route_request(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return &serial_ports[0];
+    }
+    return &serial_ports[slave_port[rtu_id]];
 }
 
 //====================================================================================================
-//========================= Thread 2: send command for SmartLogger ===================================
-void *send_command_thread(void *arg)
+//========================= Southbound Modbus TCP devices (table device_info) ========================
+//  rtu_route(rtu_id, port_id, device_id, unit_id): rows with device_id are served by that
+//  device_info(id, ip_address, tcp_port, ..., connections, max_pipeline) with unit id unit_id
+//  each device has a pool of persistent connections, each with up to max_pipeline requests on the wire
+typedef struct
 {
-    sqlite3 *db;
-    sqlite3_open("modbus_mapping.db", &db);
-    modbus_t *ctx = NULL;
-    int connected = 0;
-
-    while (1)
-    {
-        if (!connected)
-        {
-            if (ctx != NULL)
-            {
-                modbus_close(ctx);
-                modbus_free(ctx);
-            }
-            ctx = modbus_new_rtu(SERIAL_PORT, BAUDRATE, PARITY, DATA_BITS, STOP_BITS);
-            if (!ctx)
-            {
-                fprintf(stderr, "[RTU Server] Failed to create Modbus RTU connection !!!\n");
-                // write_log_log("write_log.log", "ERROR", "[RTU Server] Failed to create Modbus RTU connection !!!");
-                sleep(2);
-                continue;
-            }
+    RequestPacket req;
+    int tid; // MBAP transaction id on the connection
+    long long deadline_ms; // response timeout, closes the connection
+    int expired;           // req.deadline_ms passed and request failed, tid kept to drop the late answer
+} TcpInflight;
 
-            if (modbus_connect(ctx) == -1)
-            {
-                fprintf(stderr, "[RTU Server] Modbus RTU connection failed: %s !!!\n", modbus_strerror(errno));
-                // write_log_log("write_log.log", "ERROR", "[RTU Server] Failed to create Modbus RTU connection !!!");
-                modbus_free(ctx);
-                ctx = NULL;
-                sleep(2);
-                continue;
-            }
+typedef enum
+{
+    TCP_CLOSED,     // reconnect at deadline_ms
+    TCP_CONNECTING, // non-blocking connect, fails at deadline_ms
+    TCP_OPEN
+} TcpConnState;
 
-            connected = 1;
-            printf("[RTU Server] Connected to Modbus RTU device.\n");
-            // write_log_log("write_log.log", "INFO", "[RTU Server] Connected to Modbus RTU device.");
-        }
+typedef struct
+{
+    struct TcpDevice *device;
+    int fd;
+    TcpConnState state;
+    long long deadline_ms;
+    int retry_ms; // delay of next reconnect, see port_retry_next()
+    uint16_t next_tid;
+    TcpInflight inflight[TCP_PIPELINE_MAX];
+    int inflight_count;
+    uint8_t tx[TCP_PIPELINE_MAX * TCP_FRAME_SIZE]; // request frames not yet written
+    int tx_len;
+    uint8_t rx[2 * TCP_FRAME_SIZE];
+    int rx_len;
+} TcpConn;
 
-        RequestPacket req = take_request();
+typedef struct TcpDevice
+{
+    int device_id;
+    char ip[64];
+    int port;
+    int connections; // size of connection pool
+    int pipeline;    // outstanding requests per connection, 1 if the device answers one at a time
+    RequestQueue queue;
+    RegisterPool pool;
+    TcpConn conns[TCP_CONNECTIONS_MAX];
+    long long sent_requests; // stats
+    long long failed_requests;
+    long long reconnects;
+    long long sent_polls;
+    long long missed_polls;
+    int down; // last connect failed and no connection open
+    PollPlan plan;        // polled tags of slaves on this device
+    long long next_poll_ms; // earliest next_ms of plan blocks
+} TcpDevice;
+TcpDevice *tcp_devices = NULL;
+int tcp_device_count = 0;
+int slave_device[MAX_SLAVES]; // index in tcp_devices for each rtu_id, -1 = serial port
+int slave_unit[MAX_SLAVES];   // unit id in MBAP header
 
-        modbus_set_slave(ctx, req.rtu_id); // deivce address
+int clamp_int(int value, int min, int max)
+{
+    return value < min ? min : value > max ? max : value;
+}
 
-        int rc = -1;
-        uint16_t value[req.quantity];
-        // delay 1.5s
-        modbus_set_response_timeout(ctx, 1, 0);  // 1s
-        modbus_set_byte_timeout(ctx, 0, 500000); // 500ms
+//========================= Function: load TCP devices referenced by rtu_route =======================
+void load_tcp_devices(sqlite3 *db)
+{
+    const char *sql = "SELECT r.rtu_id, r.unit_id, d.id, d.ip_address, d.tcp_port, d.connections, d.max_pipeline "
+                      "FROM rtu_route r JOIN device_info d ON r.device_id = d.id ORDER BY d.id";
+    sqlite3_stmt *stmt;
 
-        if (req.function == 3)
+    for (int rtu_id = 0; rtu_id < MAX_SLAVES; rtu_id++)
+    {
+        slave_device[rtu_id] = -1;
+    }
+    tcp_device_count = 0;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return; // rtu_route/device_info without TCP columns -> serial only
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int rtu_id = sqlite3_column_int(stmt, 0);
+        int device_id = sqlite3_column_int(stmt, 2);
+        const char *ip = (const char *)sqlite3_column_text(stmt, 3);
+        if (rtu_id < 0 || rtu_id >= MAX_SLAVES || !ip)
         {
-            rc = modbus_read_registers(ctx, req.address, req.quantity, value);
-            printf("[RTU Server] Number of registers read (Holding Regiser 0x03): %d\n", rc);
+            continue;
         }
-        else if (req.function == 4)
+        if (tcp_device_count == 0 || tcp_devices[tcp_device_count - 1].device_id != device_id)
         {
-            rc = modbus_read_input_registers(ctx, req.address, req.quantity, value);
-            printf("[RTU Server] Number of registers read (Input Regiser 0x04): %d\n", rc);
+            if (tcp_device_count == MAX_TCP_DEVICES)
+            {
+                printf("[RTU Server TCP] More than %d devices, device %d skipped !!!\n", MAX_TCP_DEVICES, device_id);
+                continue;
+            }
+            tcp_devices = realloc(tcp_devices, (tcp_device_count + 1) * sizeof(TcpDevice));
+            TcpDevice *device = &tcp_devices[tcp_device_count++];
+            memset(device, 0, sizeof(TcpDevice));
+            device->device_id = device_id;
+            snprintf(device->ip, sizeof(device->ip), "%s", ip);
+            device->port = sqlite3_column_type(stmt, 4) == SQLITE_NULL ? 502 : sqlite3_column_int(stmt, 4);
+            device->connections = clamp_int(sqlite3_column_type(stmt, 5) == SQLITE_NULL ? 1 : sqlite3_column_int(stmt, 5), 1, TCP_CONNECTIONS_MAX);
+            device->pipeline = clamp_int(sqlite3_column_type(stmt, 6) == SQLITE_NULL ? 1 : sqlite3_column_int(stmt, 6), 1, TCP_PIPELINE_MAX);
         }
-        else
+        slave_device[rtu_id] = tcp_device_count - 1;
+        slave_unit[rtu_id] = sqlite3_column_type(stmt, 1) == SQLITE_NULL ? rtu_id : sqlite3_column_int(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+
+    for (int i = 0; i < tcp_device_count; i++) // after realloc: pointers into the array are final
+    {
+        TcpDevice *device = &tcp_devices[i];
+        init_queue(&device->queue);
+        init_pool(&device->pool);
+        for (int c = 0; c < TCP_CONNECTIONS_MAX; c++)
         {
-            printf("[RTU Server] Unsupported function: %d !!!\n", req.function);
-            // write_log_log("write_log.log", "ERROR", "[RTU Server] Unsupported function: %d !!!", req.function);
-            rc = -1;
+            device->conns[c].device = device;
+            device->conns[c].fd = -1;
+            device->conns[c].state = TCP_CLOSED;
         }
+        printf("[RTU Server TCP] Device %d: %s:%d, %d connections, %d requests per connection\n",
+               device->device_id, device->ip, device->port, device->connections, device->pipeline);
+    }
+}
 
-        ResponsePacket resp;
-        resp.transaction_id = req.transaction_id;
+//========================= Function: TCP device of rtu_id, NULL if it is on a serial port ===========
+TcpDevice *route_tcp_device(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES || slave_device[rtu_id] < 0)
+    {
+        return NULL;
+    }
+    return &tcp_devices[slave_device[rtu_id]];
+}
 
-        if (rc != -1)
+//========================= Function: take write data of request from JSON "data" ===================
+// fields of the request packet follow the Modbus PDU, "data" holds the words after it:
+//   FC6:  quantity = value to write
+//   FC16: quantity = registers, data = values
+//   FC22: quantity = AND mask, data = [OR mask]
+//   FC23: address / quantity = registers read, data = [write address, write quantity, values ...]
+// return 0 if ok, else Modbus exception code for the client
+int request_write_data(RequestPacket *req, const json_t *data)
+{
+    int count = json_is_array(data) ? (int)json_array_size(data) : 0;
+    int first = 0; // index of first value in data
+    if (req->function == 6)
+    {
+        req->write_address = req->address;
+        req->write_quantity = 1;
+        req->write_value[0] = req->quantity;
+        req->quantity = 1;
+        return 0;
+    }
+    if (req->function == 16)
+    {
+        req->write_address = req->address;
+        req->write_quantity = req->quantity;
+    }
+    else if (req->function == 22)
+    {
+        if (count != 1)
         {
-            resp.status = 0;
-            resp.value = value[0];
-            resp.rtu_id = req.rtu_id;
-            resp.address = req.address;
-            printf("[RTU Server get data] Success to get data from RTU_ID: %d with transaction_id: %d .\n", req.rtu_id, resp.transaction_id, resp.value);
-            printf("[RTU Server get data] data value:  %d .\n", resp.value);
-            // write_log_log("write_log.log", "INFO", "[RTU Server get data] Success to get data from RTU_ID: %d with transaction_id: %d . Value: %d", req.rtu_id, resp.transaction_id, resp.value);
+            return EXCEPTION_ILLEGAL_DATA_VALUE;
         }
-        else
+        req->write_address = req->address;
+        req->and_mask = req->quantity;
+        req->or_mask = json_integer_value(json_array_get(data, 0));
+        req->quantity = 1;
+        return 0;
+    }
+    else if (req->function == 23)
+    {
+        if (count < 2)
         {
-            resp.status = 1;
-            resp.value = 0;
-            connected = 0;
-            printf("[RTU Server get data] Transaction_id %d failed to get data from device, try again !!!\n", req.transaction_id);
-            // write_log_log("write_log.log", "ERROR", "[RTU Server get data] Transaction_id %d failed to get data from device !!!", req.transaction_id);
+            return EXCEPTION_ILLEGAL_DATA_VALUE;
         }
-
-        add_response(resp);
+        req->write_address = json_integer_value(json_array_get(data, 0));
+        req->write_quantity = json_integer_value(json_array_get(data, 1));
+        first = 2;
     }
-
-    if (ctx)
+    else
     {
-        modbus_close(ctx);
-        modbus_free(ctx);
+        return 0; // read, no data
     }
-
-    return NULL;
+    if (req->write_quantity < 1 || req->write_quantity > MAX_WRITE_REGISTERS || count != first + req->write_quantity)
+    {
+        return EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    for (int i = 0; i < req->write_quantity; i++)
+    {
+        req->write_value[i] = json_integer_value(json_array_get(data, first + i));
+    }
+    return 0;
 }
 
-//======================== Thread 3: send response for tcp server (modbus_response) =====================
-void *send_response_thread(void *arg)
+//========================= Function: check request from network before it is queued ================
+// return 0 if valid, else Modbus exception code for the client
+int validate_request(const RequestPacket *req)
 {
-    sqlite3 *db;
-    sqlite3_open("modbus_mapping.db", &db);
-    redisContext *redis = redisConnect("127.0.0.1", 6379);
-
+    int max_quantity;
+    if (req->function == 3 || req->function == 4 || req->function == 23)
+    {
+        max_quantity = MAX_READ_REGISTERS;
+    }
+    else if (req->function == 6 || req->function == 22)
+    {
+        max_quantity = 1;
+    }
+    else if (req->function == 16)
+    {
+        max_quantity = MAX_WRITE_REGISTERS;
+    }
+    else // FC1 / FC2: bit reads are not implemented
+    {
+        return EXCEPTION_ILLEGAL_FUNCTION;
+    }
+    if (req->quantity < 1 || req->quantity > max_quantity ||
+        (req->function == 23 && req->write_quantity > MAX_WRITE_READ_REGISTERS))
+    {
+        return EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+    if (req->address < 0 || req->address + req->quantity > 0x10000 ||
+        req->write_address < 0 || req->write_address + req->write_quantity > 0x10000)
+    {
+        return EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+    if (req->rtu_id < 0 || req->rtu_id >= MAX_SLAVES)
+    {
+        return EXCEPTION_TARGET_NO_RESPONSE;
+    }
+    return 0;
+}
+
+//====================================================================================================
+//========================= Token bucket per rtu_id (table rate_limit) ===============================
+//  rate_limit(rtu_id, max_rate, burst, cache_max_age)
+//  max_rate: requests per second, burst: bucket size, cache_max_age: ms a cached value may be reused
+//  rtu_id without row in rate_limit -> no limit
+typedef struct
+{
+    int configured;
+    double rate;      // tokens per second
+    double burst;     // max tokens
+    double tokens;    // current tokens
+    long long last_ms; // last refill time
+    int cache_max_age; // ms
+} TokenBucket;
+TokenBucket slave_buckets[MAX_SLAVES];
+pthread_mutex_t bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void load_rate_limits(sqlite3 *db)
+{
+    const char *sql = "SELECT rtu_id, max_rate, burst, cache_max_age FROM rate_limit";
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return; // no rate_limit table -> every slave unlimited
+    }
+
+    pthread_mutex_lock(&bucket_mutex);
+    for (int i = 0; i < MAX_SLAVES; i++)
+    {
+        slave_buckets[i].configured = 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int rtu_id = sqlite3_column_int(stmt, 0);
+        double rate = sqlite3_column_double(stmt, 1);
+        if (rtu_id < 0 || rtu_id >= MAX_SLAVES || rate <= 0)
+        {
+            continue;
+        }
+        TokenBucket *b = &slave_buckets[rtu_id];
+        double burst = sqlite3_column_int(stmt, 2);
+        if (burst < 1)
+        {
+            burst = 1;
+        }
+        if (b->rate != rate || b->burst != burst) // new or changed config -> start with full bucket
+        {
+            b->tokens = burst;
+            b->last_ms = now_ms();
+        }
+        b->configured = 1;
+        b->rate = rate;
+        b->burst = burst;
+        b->cache_max_age = sqlite3_column_type(stmt, 3) == SQLITE_NULL ? CACHE_MAX_AGE_MS : sqlite3_column_int(stmt, 3);
+    }
+    pthread_mutex_unlock(&bucket_mutex);
+    sqlite3_finalize(stmt);
+}
+
+//========================= Function: ms until rtu_id has a token, token is not taken =================
+long long token_wait(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return 0;
+    }
+    long long wait_ms = 0;
+    pthread_mutex_lock(&bucket_mutex);
+    TokenBucket *b = &slave_buckets[rtu_id];
+    if (b->configured)
+    {
+        double tokens = b->tokens + (now_ms() - b->last_ms) * b->rate / 1000.0;
+        if (tokens < 1.0)
+        {
+            wait_ms = (long long)((1.0 - tokens) * 1000.0 / b->rate) + 1;
+        }
+    }
+    pthread_mutex_unlock(&bucket_mutex);
+    return wait_ms;
+}
+
+//========================= Function: take one token ==================================================
+// return 0 if request can be sent now, else ms until next token
+long long take_token(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return 0;
+    }
+    long long wait_ms = 0;
+    pthread_mutex_lock(&bucket_mutex);
+    TokenBucket *b = &slave_buckets[rtu_id];
+    if (b->configured)
+    {
+        long long now = now_ms();
+        b->tokens += (now - b->last_ms) * b->rate / 1000.0;
+        if (b->tokens > b->burst)
+        {
+            b->tokens = b->burst;
+        }
+        b->last_ms = now;
+
+        if (b->tokens >= 1.0)
+        {
+            b->tokens -= 1.0;
+        }
+        else
+        {
+            wait_ms = (long long)((1.0 - b->tokens) * 1000.0 / b->rate) + 1;
+        }
+    }
+    pthread_mutex_unlock(&bucket_mutex);
+    return wait_ms;
+}
+
+int bucket_cache_max_age(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return CACHE_MAX_AGE_MS;
+    }
+    pthread_mutex_lock(&bucket_mutex);
+    int max_age = slave_buckets[rtu_id].configured ? slave_buckets[rtu_id].cache_max_age : CACHE_MAX_AGE_MS;
+    pthread_mutex_unlock(&bucket_mutex);
+    return max_age;
+}
+
+//====================================================================================================
+//========================= Retry policy per rtu_id (table retry_policy) =============================
+//  retry_policy(rtu_id, retries, retry_gap_ms, retry_on)
+//  retries: extra attempts after a failed read, retry_gap_ms: bus time left to other requests before
+//  the retry, retry_on: "crc" (bad or broken frame), "timeout" (no response) or "crc,timeout"
+//  rtu_id without row in retry_policy -> no retry, failure goes to the client at once
+#define RETRY_ON_CRC 1
+#define RETRY_ON_TIMEOUT 2
+#define RETRY_MAX 5
+
+typedef struct
+{
+    int retries;
+    int gap_ms;
+    int retry_on; // RETRY_ON_CRC | RETRY_ON_TIMEOUT
+} RetryPolicy;
+RetryPolicy slave_retry[MAX_SLAVES];
+pthread_mutex_t retry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void load_retry_policies(sqlite3 *db)
+{
+    const char *sql = "SELECT rtu_id, retries, retry_gap_ms, retry_on FROM retry_policy";
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return; // no retry_policy table -> no retries
+    }
+
+    pthread_mutex_lock(&retry_mutex);
+    memset(slave_retry, 0, sizeof(slave_retry));
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int rtu_id = sqlite3_column_int(stmt, 0);
+        if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+        {
+            continue;
+        }
+        RetryPolicy *policy = &slave_retry[rtu_id];
+        policy->retries = clamp_int(sqlite3_column_int(stmt, 1), 0, RETRY_MAX);
+        policy->gap_ms = clamp_int(sqlite3_column_int(stmt, 2), 0, 1000);
+        const char *retry_on = (const char *)sqlite3_column_text(stmt, 3);
+        if (retry_on == NULL)
+        {
+            policy->retry_on = RETRY_ON_CRC | RETRY_ON_TIMEOUT;
+        }
+        else
+        {
+            policy->retry_on = (strstr(retry_on, "crc") ? RETRY_ON_CRC : 0) | (strstr(retry_on, "timeout") ? RETRY_ON_TIMEOUT : 0);
+        }
+    }
+    pthread_mutex_unlock(&retry_mutex);
+    sqlite3_finalize(stmt);
+}
+
+//========================= Function: 1 if failed attempt of a read may be repeated ==================
+// gap_ms: delay before the retry. Exception responses and port faults are never retried.
+int retry_allowed(const RequestPacket *req, int err, int *gap_ms)
+{
+    if (req->rtu_id < 0 || req->rtu_id >= MAX_SLAVES || req->transaction_id == PROBE_TRANSACTION_ID ||
+        req->transaction_id == DISCOVERY_TRANSACTION_ID)
+    {
+        return 0;
+    }
+    int kind = err == EMBBADCRC || err == EMBBADDATA ? RETRY_ON_CRC : err == ETIMEDOUT ? RETRY_ON_TIMEOUT : 0;
+    pthread_mutex_lock(&retry_mutex);
+    RetryPolicy policy = slave_retry[req->rtu_id];
+    pthread_mutex_unlock(&retry_mutex);
+    *gap_ms = policy.gap_ms;
+    return (policy.retry_on & kind) && req->attempt < policy.retries;
+}
+
+//====================================================================================================
+//========================= Value cache: last value read per (rtu_id, function, address) =============
+typedef struct
+{
+    int used;
+    int rtu_id;
+    int function;
+    int address;
+    int value;
+    long long time_ms; // time of reading
+} CacheEntry;
+CacheEntry value_cache[CACHE_SIZE];
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int cache_slot(int rtu_id, int function, int address)
+{
+    unsigned int h = (unsigned int)rtu_id * 2654435761u ^ (unsigned int)function * 40503u ^ (unsigned int)address * 97u;
+    return h & (CACHE_SIZE - 1);
+}
+
+void cache_store(int rtu_id, int function, int address, int value)
+{
+    unsigned int slot = cache_slot(rtu_id, function, address);
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < CACHE_SIZE; i++) // linear probing, reuse own slot or first free one
+    {
+        CacheEntry *e = &value_cache[(slot + i) & (CACHE_SIZE - 1)];
+        if (!e->used || (e->rtu_id == rtu_id && e->function == function && e->address == address))
+        {
+            e->used = 1;
+            e->rtu_id = rtu_id;
+            e->function = function;
+            e->address = address;
+            e->value = value;
+            e->time_ms = now_ms();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// written registers: new values are cached, result of FC22 mask write is unknown -> old value expires
+void cache_store_written(const RequestPacket *req)
+{
+    for (int i = 0; i < req->write_quantity; i++)
+    {
+        cache_store(req->rtu_id, 3, req->write_address + i, req->write_value[i]);
+    }
+    if (req->function != 22)
+    {
+        return;
+    }
+    unsigned int slot = cache_slot(req->rtu_id, 3, req->write_address);
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < CACHE_SIZE; i++)
+    {
+        CacheEntry *e = &value_cache[(slot + i) & (CACHE_SIZE - 1)];
+        if (!e->used)
+        {
+            break;
+        }
+        if (e->rtu_id == req->rtu_id && e->function == 3 && e->address == req->write_address)
+        {
+            e->time_ms = LLONG_MIN / 2; // older than any max age, slot stays in the probe chain
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// return 1 and fill *value if a value younger than max_age_ms is cached
+int cache_lookup(int rtu_id, int function, int address, int max_age_ms, int *value)
+{
+    unsigned int slot = cache_slot(rtu_id, function, address);
+    int found = 0;
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < CACHE_SIZE; i++)
+    {
+        CacheEntry *e = &value_cache[(slot + i) & (CACHE_SIZE - 1)];
+        if (!e->used)
+        {
+            break;
+        }
+        if (e->rtu_id == rtu_id && e->function == function && e->address == address)
+        {
+            if (now_ms() - e->time_ms <= max_age_ms)
+            {
+                *value = e->value;
+                found = 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return found;
+}
+
+//====================================================================================================
+//========================= Response time per rtu_id -> adaptive response timeout ====================
+// time to first byte of response is tracked as EWMA + mean deviation (like TCP RTT) and
+// the last LATENCY_SAMPLES values for a high percentile. timeout = max(ewma + 4 * dev, p99 * 1.5),
+// limited to [TIMEOUT_FLOOR_MS, RESPONSE_TIMEOUT_MS]. Every timeout in a row doubles it again.
+typedef struct
+{
+    double ewma_ms;
+    double dev_ms;
+    uint16_t samples[LATENCY_SAMPLES]; // ring buffer, ms
+    int count;
+    int next;
+    int timeouts; // timeouts in a row
+    double planned_ms; // ewma_ms the poll plans were compiled with
+    int version;       // changes with planned_ms, the plan of the slave's port compiles again
+} SlaveLatency;
+SlaveLatency slave_latency[MAX_SLAVES];
+pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//========================= Function: time to send bytes on serial port in ms ========================
+double frame_time_ms(const SerialPort *port, double bytes)
+{
+    int bits = 1 + port->data_bits + (port->parity == 'N' ? 0 : 1) + port->stop_bits; // start bit, data, parity, stop
+    return bytes * bits * 1000.0 / port->baudrate;
+}
+
+//========================= Function: save one response time =========================================
+void latency_record(int rtu_id, double ms)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return;
+    }
+    if (ms < 0)
+    {
+        ms = 0;
+    }
+    pthread_mutex_lock(&latency_mutex);
+    SlaveLatency *l = &slave_latency[rtu_id];
+    if (l->count == 0)
+    {
+        l->ewma_ms = ms;
+        l->dev_ms = ms / 2;
+    }
+    else
+    {
+        double err = ms - l->ewma_ms;
+        l->ewma_ms += err / 8;
+        l->dev_ms += ((err < 0 ? -err : err) - l->dev_ms) / 4;
+    }
+    l->samples[l->next] = ms > 65535 ? 65535 : (uint16_t)ms;
+    l->next = (l->next + 1) % LATENCY_SAMPLES;
+    if (l->count < LATENCY_SAMPLES)
+    {
+        l->count++;
+    }
+    l->timeouts = 0;
+    double drift = l->ewma_ms - l->planned_ms;
+    double limit = l->planned_ms * PLAN_TURNAROUND_DRIFT;
+    if (l->count == LATENCY_MIN_SAMPLES ||
+        (l->count > LATENCY_MIN_SAMPLES && fabs(drift) > (limit > PLAN_TURNAROUND_DRIFT_MS ? limit : PLAN_TURNAROUND_DRIFT_MS)))
+    {
+        l->planned_ms = l->ewma_ms; // first measured value, or slave got faster / slower
+        l->version++;
+    }
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+//========================= Function: save one timeout ===============================================
+void latency_timeout(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return;
+    }
+    pthread_mutex_lock(&latency_mutex);
+    slave_latency[rtu_id].timeouts++;
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+int compare_u16(const void *a, const void *b)
+{
+    return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+//========================= Function: response timeout for next request to rtu_id in ms ==============
+// until LATENCY_MIN_SAMPLES responses are known the full RESPONSE_TIMEOUT_MS is used
+int slave_timeout_ms(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return RESPONSE_TIMEOUT_MS;
+    }
+    pthread_mutex_lock(&latency_mutex);
+    SlaveLatency *l = &slave_latency[rtu_id];
+    if (l->count < LATENCY_MIN_SAMPLES)
+    {
+        pthread_mutex_unlock(&latency_mutex);
+        return RESPONSE_TIMEOUT_MS;
+    }
+    uint16_t sorted[LATENCY_SAMPLES];
+    memcpy(sorted, l->samples, l->count * sizeof(uint16_t));
+    qsort(sorted, l->count, sizeof(uint16_t), compare_u16);
+    double p99 = sorted[(l->count * 99) / 100];
+    double timeout = l->ewma_ms + 4 * l->dev_ms;
+    if (p99 * 1.5 > timeout)
+    {
+        timeout = p99 * 1.5;
+    }
+    timeout *= 1 << (l->timeouts < 4 ? l->timeouts : 4);
+    pthread_mutex_unlock(&latency_mutex);
+
+    if (timeout < TIMEOUT_FLOOR_MS)
+    {
+        timeout = TIMEOUT_FLOOR_MS;
+    }
+    if (timeout > RESPONSE_TIMEOUT_MS)
+    {
+        timeout = RESPONSE_TIMEOUT_MS;
+    }
+    return (int)timeout;
+}
+
+//========================= Function: max gap between bytes of response in ms ========================
+// a few characters at the port speed plus TIMEOUT_FLOOR_MS for USB adapters and scheduling
+int byte_timeout_ms(const SerialPort *port)
+{
+    int timeout = (int)frame_time_ms(port, 4) + TIMEOUT_FLOOR_MS;
+    return timeout < BYTE_TIMEOUT_MS ? timeout : BYTE_TIMEOUT_MS;
+}
+
+//========================= Function: 1 if slave sent a response (data, exception or bad frame) ======
+int slave_answered(int rc, int err)
+{
+    return rc != -1 || err == EMBBADCRC || err == EMBBADDATA || (err > MODBUS_ENOBASE && err < MODBUS_ENOBASE + 0x20);
+}
+
+//========================= Function: 1 if err is a fault of the serial port itself ==================
+// device unplugged, I/O error or bad handle -> reopen tty. Timeout, CRC error and exception
+// response are errors of one slave, the port stays open.
+int port_fault(int err)
+{
+    return err == EIO || err == ENXIO || err == ENODEV || err == EBADF || err == EPIPE;
+}
+
+//========================= Function: next delay of reopen schedule 0, 50, 100, ... 2000 ms ==========
+int port_retry_next(int retry_ms)
+{
+    if (retry_ms == 0)
+    {
+        return PORT_RETRY_MIN_MS;
+    }
+    return retry_ms * 2 < PORT_RETRY_MAX_MS ? retry_ms * 2 : PORT_RETRY_MAX_MS;
+}
+
+//====================================================================================================
+//========================= Circuit breaker per rtu_id ===============================================
+// closed: requests are sent. BREAKER_FAILURES timeouts in a row -> open: requests get exception 0x0B
+// at once. After backoff the port worker sends one probe (half-open): response -> closed,
+// timeout -> open again with double backoff (max BREAKER_BACKOFF_MAX_MS).
+typedef enum
+{
+    BREAKER_CLOSED,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN
+} BreakerState;
+
+typedef struct
+{
+    BreakerState state;
+    int failures;      // timeouts in a row
+    int backoff_ms;    // current wait between probes
+    long long probe_ms; // time of next probe when open
+    int has_probe;
+    RequestPacket probe; // last request sent to slave, read again with quantity 1 as probe
+} CircuitBreaker;
+CircuitBreaker slave_breakers[MAX_SLAVES];
+pthread_mutex_t breaker_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const char *breaker_name(BreakerState state)
+{
+    return state == BREAKER_OPEN ? "open" : state == BREAKER_HALF_OPEN ? "half-open" : "closed";
+}
+
+//========================= Function: 1 if requests to rtu_id may be sent ============================
+// also remembers req as probe for later
+int breaker_allow(const RequestPacket *req)
+{
+    if (req->rtu_id < 0 || req->rtu_id >= MAX_SLAVES)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&breaker_mutex);
+    CircuitBreaker *b = &slave_breakers[req->rtu_id];
+    int allow = b->state == BREAKER_CLOSED;
+    if (allow && (req->function == 3 || req->function == 4))
+    {
+        b->probe = *req;
+        b->probe.transaction_id = PROBE_TRANSACTION_ID;
+        b->probe.quantity = 1;
+        b->has_probe = 1;
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+    return allow;
+}
+
+//========================= Function: slave answered ==================================================
+void breaker_success(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return;
+    }
+    pthread_mutex_lock(&breaker_mutex);
+    CircuitBreaker *b = &slave_breakers[rtu_id];
+    if (b->state != BREAKER_CLOSED)
+    {
+        printf("[RTU Server breaker] RTU_ID %d answered, breaker closed.\n", rtu_id);
+    }
+    b->state = BREAKER_CLOSED;
+    b->failures = 0;
+    b->backoff_ms = 0;
+    pthread_mutex_unlock(&breaker_mutex);
+}
+
+//========================= Function: slave did not answer ===========================================
+void breaker_failure(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return;
+    }
+    pthread_mutex_lock(&breaker_mutex);
+    CircuitBreaker *b = &slave_breakers[rtu_id];
+    b->failures++;
+    if (b->state == BREAKER_HALF_OPEN || (b->state == BREAKER_CLOSED && b->failures >= BREAKER_FAILURES))
+    {
+        b->backoff_ms = b->state == BREAKER_HALF_OPEN ? b->backoff_ms * 2 : BREAKER_BACKOFF_MS;
+        if (b->backoff_ms > BREAKER_BACKOFF_MAX_MS)
+        {
+            b->backoff_ms = BREAKER_BACKOFF_MAX_MS;
+        }
+        b->state = BREAKER_OPEN;
+        b->probe_ms = now_ms() + b->backoff_ms;
+        printf("[RTU Server breaker] RTU_ID %d not answering, breaker open, next probe in %d ms !!!\n", rtu_id, b->backoff_ms);
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+}
+
+//========================= Function: probe ended without answer or timeout (port error) =============
+void breaker_probe_done(int rtu_id)
+{
+    pthread_mutex_lock(&breaker_mutex);
+    CircuitBreaker *b = &slave_breakers[rtu_id];
+    if (b->state == BREAKER_HALF_OPEN) // no verdict, probe again after same backoff
+    {
+        b->state = BREAKER_OPEN;
+        b->probe_ms = now_ms() + b->backoff_ms;
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+}
+
+//========================= Function: probe due on serial port =======================================
+// return 1 and fill *req with probe of an open breaker whose backoff passed, else lower *wake_ms
+int breaker_take_probe(SerialPort *port, RequestPacket *req, long long *wake_ms)
+{
+    int found = 0;
+    long long now = now_ms();
+    pthread_mutex_lock(&breaker_mutex);
+    for (int rtu_id = 0; rtu_id < MAX_SLAVES && !found; rtu_id++)
+    {
+        CircuitBreaker *b = &slave_breakers[rtu_id];
+        if (b->state != BREAKER_OPEN || route_request(rtu_id) != port)
+        {
+            continue;
+        }
+        if (!b->has_probe)
+        {
+            b->state = BREAKER_CLOSED; // nothing to probe with, let next request try
+            b->failures = 0;
+        }
+        else if (b->probe_ms <= now)
+        {
+            b->state = BREAKER_HALF_OPEN;
+            *req = b->probe;
+            found = 1;
+        }
+        else if (b->probe_ms < *wake_ms)
+        {
+            *wake_ms = b->probe_ms;
+        }
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+    return found;
+}
+
+//====================================================================================================
+//========================= Device profiles: what each slave accepts (table device_profile) ==========
+//  device_profile(rtu_id, max_read_registers, unsupported_functions, frame_gap_ms, gap_reads, manual)
+//  learned from answers of the slave and saved to the table, a restart does not repeat the exceptions:
+//    exception 0x01                          -> function unsupported, client requests fail at once
+//    exception 0x03 on a read of n registers -> max_read_registers halfway between the biggest read
+//                                               answered and n; a read of max_read_registers that is
+//                                               answered moves it halfway up again (binary search)
+//    exception 0x02 on a poll block with gap -> gap_reads = 0, only adjacent tags are merged
+//    timeout right after other bus traffic   -> frame_gap_ms doubles (2 .. 50 ms) on trial, only if
+//                                               the request before was answered. Answered request
+//                                               after it: gap stays, saved after the second such
+//                                               retry; timeout: back to the gap before. The gap is
+//                                               halved after PROFILE_GAP_DECAY_ANSWERS answers
+//  poll plans and the scheduler (FC23 merge, split of client reads) follow the profile.
+//  rows with manual = 1 are set by hand and never learned over
+#define PROFILE_GAP_STEP_MS 2     // first learned frame gap
+#define PROFILE_GAP_MAX_MS 50
+#define PROFILE_SHORT_IDLE_MS 10  // timeout after less bus silence than frame_gap_ms + this -> gap too short
+#define PROFILE_GAP_EVIDENCE 2    // answered retries after a longer gap before the gap is saved
+#define PROFILE_GAP_DECAY_ANSWERS 1000 // answers in a row before the gap is halved
+
+typedef struct
+{
+    int max_read;         // registers per FC3 / FC4 read, 0 = 125
+    int largest_read;     // biggest read answered since start, not saved
+    int refused_read;     // smallest read refused with exception 0x03 since start, not saved
+    unsigned int unsupported; // bit n: function n answered with exception 0x01
+    int frame_gap_ms;     // bus silence needed before a request to this slave (plus t3.5)
+    int confirmed_gap_ms; // frame gap saved to the table, frame_gap_ms may be on trial above it
+    int gap_trial;        // frame_gap_ms raised after a timeout, next request tests it
+    int gap_before_ms;    // frame gap before the trial
+    int gap_retries;      // answered retries after a longer gap since the gap was saved
+    int gap_answers;      // answered requests since the gap changed
+    int no_gap_reads;     // 1: reads must not include registers between tags
+    int manual;           // row with manual = 1, nothing is learned
+    int answered;         // last request was answered (frame gap learning)
+    int dirty;            // learned, not saved yet
+    int version;          // counts learned changes, dirty is cleared only if none came in while saving
+} DeviceProfile;
+DeviceProfile device_profiles[MAX_SLAVES];
+int profile_version = 0; // changes with max_read / no_gap_reads of any slave, poll plans compile again
+pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//========================= Function: write learned profiles, rows with manual = 1 stay ===============
+// table device_profile is created by init_db() of database_service.py
+void save_device_profiles(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO device_profile (rtu_id, max_read_registers, unsupported_functions, "
+                               "frame_gap_ms, gap_reads, manual) SELECT ?1, ?2, ?3, ?4, ?5, 0 WHERE NOT EXISTS "
+                               "(SELECT 1 FROM device_profile WHERE rtu_id = ?1 AND manual = 1)", -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return;
+    }
+    for (int rtu_id = 0; rtu_id < MAX_SLAVES; rtu_id++)
+    {
+        pthread_mutex_lock(&profile_mutex);
+        DeviceProfile profile = device_profiles[rtu_id];
+        pthread_mutex_unlock(&profile_mutex);
+        if (!profile.dirty)
+        {
+            continue;
+        }
+        char functions[128] = "";
+        for (int fc = 1; fc < 32; fc++)
+        {
+            if (profile.unsupported & (1u << fc))
+            {
+                sprintf(functions + strlen(functions), "%s%d", functions[0] ? "," : "", fc);
+            }
+        }
+        sqlite3_bind_int(stmt, 1, rtu_id);
+        sqlite3_bind_int(stmt, 2, profile.max_read ? profile.max_read : MAX_READ_REGISTERS);
+        sqlite3_bind_text(stmt, 3, functions, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 4, profile.confirmed_gap_ms);
+        sqlite3_bind_int(stmt, 5, !profile.no_gap_reads);
+        if (sqlite3_step(stmt) == SQLITE_DONE)
+        {
+            pthread_mutex_lock(&profile_mutex);
+            if (device_profiles[rtu_id].version == profile.version) // else learned again meanwhile, save next time
+            {
+                device_profiles[rtu_id].dirty = 0;
+            }
+            pthread_mutex_unlock(&profile_mutex);
+            printf("[RTU Server profile] RTU_ID %d: max read %d, unsupported functions [%s], frame gap %d ms, gap reads %d saved.\n",
+                   rtu_id, profile.max_read ? profile.max_read : MAX_READ_REGISTERS, functions, profile.confirmed_gap_ms, !profile.no_gap_reads);
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+}
+
+//========================= Function: save learned profiles, then load table device_profile ==========
+// slaves without row get the default profile, unless something learned could not be saved yet.
+// main() loads once before the threads start, then only data_log_thread(): no bus thread waits on the database
+void load_device_profiles(sqlite3 *db)
+{
+    save_device_profiles(db);
+    const char *sql = "SELECT rtu_id, max_read_registers, unsupported_functions, frame_gap_ms, gap_reads, manual FROM device_profile";
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return; // no device_profile table -> nothing learned yet
+    }
+
+    DeviceProfile *loaded = calloc(MAX_SLAVES, sizeof(DeviceProfile));
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int rtu_id = sqlite3_column_int(stmt, 0);
+        if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+        {
+            continue;
+        }
+        DeviceProfile *profile = &loaded[rtu_id];
+        profile->max_read = sqlite3_column_type(stmt, 1) == SQLITE_NULL ? 0 : clamp_int(sqlite3_column_int(stmt, 1), 1, MAX_READ_REGISTERS);
+        const char *functions = (const char *)sqlite3_column_text(stmt, 2);
+        while (functions && *functions)
+        {
+            char *end;
+            long fc = strtol(functions, &end, 10);
+            if (end == functions)
+            {
+                functions++; // separator
+                continue;
+            }
+            if (fc > 0 && fc < 32)
+            {
+                profile->unsupported |= 1u << fc;
+            }
+            functions = end;
+        }
+        profile->frame_gap_ms = clamp_int(sqlite3_column_int(stmt, 3), 0, 1000);
+        profile->confirmed_gap_ms = profile->frame_gap_ms;
+        profile->no_gap_reads = sqlite3_column_type(stmt, 4) != SQLITE_NULL && sqlite3_column_int(stmt, 4) == 0;
+        profile->manual = sqlite3_column_int(stmt, 5);
+    }
+    sqlite3_finalize(stmt);
+
+    pthread_mutex_lock(&profile_mutex);
+    for (int rtu_id = 0; rtu_id < MAX_SLAVES; rtu_id++)
+    {
+        DeviceProfile *profile = &device_profiles[rtu_id];
+        if (profile->dirty)
+        {
+            continue;
+        }
+        if (profile->max_read != loaded[rtu_id].max_read || profile->no_gap_reads != loaded[rtu_id].no_gap_reads)
+        {
+            profile_version++;
+        }
+        loaded[rtu_id].largest_read = profile->largest_read;
+        loaded[rtu_id].refused_read = profile->refused_read;
+        loaded[rtu_id].answered = profile->answered;
+        loaded[rtu_id].version = profile->version;
+        if (!loaded[rtu_id].manual && loaded[rtu_id].frame_gap_ms == profile->confirmed_gap_ms)
+        {
+            // row not changed by hand: keep a gap on trial or not confirmed yet
+            loaded[rtu_id].frame_gap_ms = profile->frame_gap_ms;
+            loaded[rtu_id].gap_trial = profile->gap_trial;
+            loaded[rtu_id].gap_before_ms = profile->gap_before_ms;
+            loaded[rtu_id].gap_retries = profile->gap_retries;
+            loaded[rtu_id].gap_answers = profile->gap_answers;
+        }
+        *profile = loaded[rtu_id];
+    }
+    pthread_mutex_unlock(&profile_mutex);
+    free(loaded);
+}
+
+//========================= Function: learn frame gap from the result of a request, profile_mutex held =
+// a single timeout after short bus silence can be noise: the longer gap is only tried on the next
+// request and saved once retries after a longer gap were answered PROFILE_GAP_EVIDENCE times
+void profile_learn_gap(DeviceProfile *profile, int rtu_id, int answered_before, int measured, int err, double idle_ms)
+{
+    if (profile->gap_trial)
+    {
+        profile->gap_trial = 0;
+        profile->gap_answers = 0;
+        if (!profile->answered)
+        {
+            printf("[RTU Server profile] RTU_ID %d missed request after frame gap %d ms too, frame gap %d ms.\n",
+                   rtu_id, profile->frame_gap_ms, profile->gap_before_ms);
+            profile->frame_gap_ms = profile->gap_before_ms; // not the gap, slave did not answer
+            profile->gap_retries = 0;
+        }
+        else if (++profile->gap_retries >= PROFILE_GAP_EVIDENCE && profile->confirmed_gap_ms != profile->frame_gap_ms)
+        {
+            profile->confirmed_gap_ms = profile->frame_gap_ms;
+            profile->dirty = 1;
+            profile->version++;
+            printf("[RTU Server profile] RTU_ID %d answered again after longer bus silence, frame gap %d ms.\n",
+                   rtu_id, profile->frame_gap_ms);
+        }
+    }
+    else if (profile->answered)
+    {
+        if (profile->frame_gap_ms > 0 && ++profile->gap_answers >= PROFILE_GAP_DECAY_ANSWERS)
+        {
+            profile->frame_gap_ms = profile->frame_gap_ms / 2 >= PROFILE_GAP_STEP_MS ? profile->frame_gap_ms / 2 : 0;
+            profile->gap_answers = 0;
+            profile->gap_retries = 0;
+            if (profile->confirmed_gap_ms > profile->frame_gap_ms)
+            {
+                profile->confirmed_gap_ms = profile->frame_gap_ms;
+                profile->dirty = 1;
+                profile->version++;
+            }
+            printf("[RTU Server profile] RTU_ID %d answered %d requests, frame gap %d ms.\n",
+                   rtu_id, PROFILE_GAP_DECAY_ANSWERS, profile->frame_gap_ms);
+        }
+    }
+    else if (err == ETIMEDOUT && answered_before && measured && idle_ms >= 0 &&
+             idle_ms < profile->frame_gap_ms + PROFILE_SHORT_IDLE_MS && profile->frame_gap_ms < PROFILE_GAP_MAX_MS)
+    {
+        profile->gap_before_ms = profile->frame_gap_ms;
+        profile->frame_gap_ms = profile->frame_gap_ms ? 2 * profile->frame_gap_ms : PROFILE_GAP_STEP_MS;
+        profile->frame_gap_ms = profile->frame_gap_ms < PROFILE_GAP_MAX_MS ? profile->frame_gap_ms : PROFILE_GAP_MAX_MS;
+        profile->gap_trial = 1;
+        profile->gap_answers = 0;
+        printf("[RTU Server profile] RTU_ID %d missed request %.1f ms after bus traffic, trying frame gap %d ms.\n",
+               rtu_id, idle_ms, profile->frame_gap_ms);
+    }
+}
+
+//========================= Function: learn from the result of a request on the bus ==================
+// rc / err as for finish_request, idle_ms: bus silence before the request was sent, -1 if unknown
+void profile_learn(const RequestPacket *req, int rc, int err, double idle_ms)
+{
+    if (req->rtu_id < 1 || req->rtu_id >= MAX_SLAVES || req->transaction_id == DISCOVERY_TRANSACTION_ID)
+    {
+        return;
+    }
+    pthread_mutex_lock(&latency_mutex);
+    int measured = slave_latency[req->rtu_id].count >= LATENCY_MIN_SAMPLES;
+    pthread_mutex_unlock(&latency_mutex);
+
+    int read = req->function == 3 || req->function == 4;
+    pthread_mutex_lock(&profile_mutex);
+    DeviceProfile *profile = &device_profiles[req->rtu_id];
+    int answered = profile->answered;
+    profile->answered = rc != -1 || (err >= EMBXILFUN && err <= EMBXGTAR);
+    if (rc != -1 && read)
+    {
+        profile->largest_read = req->quantity > profile->largest_read ? req->quantity : profile->largest_read;
+        if (!profile->manual && req->quantity == profile->max_read && profile->refused_read - req->quantity > 1)
+        {
+            profile->max_read = (req->quantity + profile->refused_read) / 2; // limit is between them
+            profile->dirty = 1;
+            profile->version++;
+            profile_version++;
+            printf("[RTU Server profile] RTU_ID %d answered read of %d registers, max read %d.\n", req->rtu_id, req->quantity, profile->max_read);
+        }
+    }
+    else if (rc != -1 || profile->manual)
+    {
+        // nothing to learn, or set by hand
+    }
+    else if (err == EMBXILFUN && req->function < 32 && !(profile->unsupported & (1u << req->function)))
+    {
+        profile->unsupported |= 1u << req->function;
+        profile->dirty = 1;
+        profile->version++;
+        printf("[RTU Server profile] RTU_ID %d does not support function %d.\n", req->rtu_id, req->function);
+    }
+    else if (err == EMBXILVAL && read && req->quantity > 1 && req->quantity > profile->largest_read)
+    {
+        profile->refused_read = profile->refused_read && profile->refused_read < req->quantity ? profile->refused_read : req->quantity;
+        int max_read = (profile->largest_read + profile->refused_read) / 2;
+        max_read = max_read > profile->largest_read ? max_read : profile->largest_read;
+        if (!profile->max_read || max_read < profile->max_read)
+        {
+            profile->max_read = max_read;
+            profile->dirty = 1;
+            profile->version++;
+            profile_version++;
+            printf("[RTU Server profile] RTU_ID %d refused read of %d registers, max read %d.\n", req->rtu_id, req->quantity, max_read);
+        }
+    }
+    else if (err == EMBXILADD && req->read_gaps && !profile->no_gap_reads)
+    {
+        profile->no_gap_reads = 1;
+        profile->dirty = 1;
+        profile->version++;
+        profile_version++;
+        printf("[RTU Server profile] RTU_ID %d refused read over registers between tags, no gap reads.\n", req->rtu_id);
+    }
+    if (!profile->manual)
+    {
+        profile_learn_gap(profile, req->rtu_id, answered, measured, err, idle_ms);
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+//========================= Function: 1 if slave is not known to refuse function =====================
+int profile_supports(int rtu_id, int function)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES || function >= 32)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&profile_mutex);
+    int supported = !(device_profiles[rtu_id].unsupported & (1u << function));
+    pthread_mutex_unlock(&profile_mutex);
+    return supported;
+}
+
+//========================= Function: max registers of one FC3 / FC4 read of slave ====================
+int profile_max_read(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return MAX_READ_REGISTERS;
+    }
+    pthread_mutex_lock(&profile_mutex);
+    int max_read = device_profiles[rtu_id].max_read;
+    pthread_mutex_unlock(&profile_mutex);
+    return max_read ? max_read : MAX_READ_REGISTERS;
+}
+
+//========================= Function: 1 if slave answers reads over registers between tags ===========
+int profile_gap_reads(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&profile_mutex);
+    int gap_reads = !device_profiles[rtu_id].no_gap_reads;
+    pthread_mutex_unlock(&profile_mutex);
+    return gap_reads;
+}
+
+//========================= Function: bus silence in ms the slave needs before a request ==============
+int profile_frame_gap_ms(int rtu_id)
+{
+    if (rtu_id < 0 || rtu_id >= MAX_SLAVES)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&profile_mutex);
+    int gap_ms = device_profiles[rtu_id].frame_gap_ms;
+    pthread_mutex_unlock(&profile_mutex);
+    return gap_ms;
+}
+
+//====================================================================================================
+//========================= Data log: polled values buffered for table data_log =====================
+//  samples are written by Thread 4 in batches, one transaction per batch.
+//  polled tags are logged when they are published (change beyond deadband or heartbeat)
+typedef struct
+{
+    long long time_ms; // wall clock of sample
+    int rtu_id;
+    int rtu_address;
+    int value;
+} DataSample;
+
+DataSample data_log_buffer[DATA_LOG_SIZE];
+int data_log_front = 0;
+int data_log_count = 0;
+long long data_log_first_ms = 0; // monotonic time of oldest buffered sample
+long long data_log_logged = 0;
+long long data_log_dropped = 0;
+pthread_mutex_t data_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t data_log_cond = PTHREAD_COND_INITIALIZER;
+
+//========================= Function: add sample to data log buffer ==================================
+// buffer full (storage too slow): sample is dropped and counted
+void data_log_add(int rtu_id, int rtu_address, int value)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    pthread_mutex_lock(&data_log_mutex);
+    if (data_log_count == DATA_LOG_SIZE)
+    {
+        data_log_dropped++;
+        pthread_mutex_unlock(&data_log_mutex);
+        return;
+    }
+    if (data_log_count == 0)
+    {
+        data_log_first_ms = now_ms();
+    }
+    DataSample *sample = &data_log_buffer[(data_log_front + data_log_count) % DATA_LOG_SIZE];
+    sample->time_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    sample->rtu_id = rtu_id;
+    sample->rtu_address = rtu_address;
+    sample->value = value;
+    data_log_count++;
+    if (data_log_count == DATA_LOG_BATCH)
+    {
+        pthread_cond_signal(&data_log_cond);
+    }
+    pthread_mutex_unlock(&data_log_mutex);
+}
+
+//====================================================================================================
+//========================= Tag updates: changed values for Redis channel modbus_data ================
+//  only tags that changed more than their deadband (or were silent too long) are queued
+typedef struct
+{
+    int tag_id;
+    int rtu_id;
+    int function;
+    int address;
+    int quantity;
+    long long time_ms; // wall clock of read
+    uint16_t value[125];
+    char name[TAG_NAME_SIZE]; // template tag: name and typed value are published too
+    TagType type;
+    int word_swap;
+    double scale;
+} TagUpdate;
+
+TagUpdate tag_updates[TAG_UPDATE_SIZE];
+int tag_update_front = 0;
+int tag_update_count = 0;
+long long tag_updates_published = 0;
+long long tag_updates_dropped = 0;
+pthread_mutex_t tag_update_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tag_update_cond = PTHREAD_COND_INITIALIZER;
+
+//========================= Function: queue update of tag for publishing =============================
+void tag_update_add(const TagUpdate *update)
+{
+    pthread_mutex_lock(&tag_update_mutex);
+    if (tag_update_count == TAG_UPDATE_SIZE)
+    {
+        tag_updates_dropped++; // Redis too slow
+    }
+    else
+    {
+        tag_updates[(tag_update_front + tag_update_count) % TAG_UPDATE_SIZE] = *update;
+        tag_update_count++;
+        pthread_cond_signal(&tag_update_cond);
+    }
+    pthread_mutex_unlock(&tag_update_mutex);
+}
+
+//====================================================================================================
+//========================= Polling: tags of table get_data read by scan rate ========================
+//  get_data(tcp_address, tcp_port, function_code, start_address, quantity, description, rtu_id, scan_rate_ms)
+//  tags of one slave, function and scan rate are merged into block reads (poll plan).
+//  the plan of a port is compiled again when get_data changed (PRAGMA data_version), a device profile
+//  changed or the measured response time of a slave moved (cost model)
+
+//========================= Function: bus time in ms of one read of quantity registers ===============
+// request frame + wait for first byte + response frame + 3.5 char silence after each frame
+double read_cost_ms(const SerialPort *port, int rtu_id, int quantity)
+{
+    double first_byte_ms = frame_time_ms(port, 8) + PLAN_TURNAROUND_MS; // slave without measured response time
+    pthread_mutex_lock(&latency_mutex);
+    if (rtu_id >= 0 && rtu_id < MAX_SLAVES && slave_latency[rtu_id].count >= LATENCY_MIN_SAMPLES)
+    {
+        first_byte_ms = slave_latency[rtu_id].planned_ms;
+    }
+    pthread_mutex_unlock(&latency_mutex);
+    return first_byte_ms + frame_time_ms(port, 5 + 2 * quantity) + 2 * frame_time_ms(port, 3.5);
+}
+
+//========================= Function: latency version of the slaves of a plan =======================
+// sum of the versions of its slaves, versions only grow: changes when one of them moved
+int plan_latency_version(const PollPlan *plan)
+{
+    int version = 0;
+    pthread_mutex_lock(&latency_mutex);
+    for (int t = 0; t < plan->tag_count; t++)
+    {
+        if (t == 0 || plan->tags[t].rtu_id != plan->tags[t - 1].rtu_id) // tags sorted by rtu_id
+        {
+            version += slave_latency[plan->tags[t].rtu_id].version;
+        }
+    }
+    pthread_mutex_unlock(&latency_mutex);
+    return version;
+}
+
+// by slave, function, scan rate, then start of the read: a template tag sorts at the start of its
+// recommended block, before the other tags inside the block
+int compare_poll_tag(const void *a, const void *b)
+{
+    const PollTag *x = a, *y = b;
+    if (x->rtu_id != y->rtu_id)
+        return x->rtu_id - y->rtu_id;
+    if (x->function != y->function)
+        return x->function - y->function;
+    if (x->scan_ms != y->scan_ms)
+        return x->scan_ms - y->scan_ms;
+    int x_start = x->block_quantity > 0 ? x->block_address : x->address;
+    int y_start = y->block_quantity > 0 ? y->block_address : y->address;
+    if (x_start != y_start)
+        return x_start - y_start;
+    if ((x->block_quantity > 0) != (y->block_quantity > 0))
+        return y->block_quantity > 0 ? 1 : -1;
+    return x->address - y->address;
+}
+
+//========================= Function: compile tags into block reads ==================================
+// tags sorted by compare_poll_tag(). A tag joins the open block if the block stays
+// within the max read of the slave (125 registers or less, device profile) and, on a serial port,
+// reading the gap costs less bus time than a separate request. On Modbus TCP a request costs a round
+// trip, the gap bytes almost nothing: port NULL, always merge. Slaves without gap reads merge
+// adjacent and overlapping tags only. A tag of a device template opens the recommended block read
+// containing it as it is (block plan of the template) and tags inside it join it.
+// Recompiled with the same tags (profile or latency changed) only blocks that change are reset.
+void poll_plan_compile(PollPlan *plan, const SerialPort *port, const char *name, int tags_changed)
+{
+    PollBlock *old_blocks = plan->blocks;
+    int old_count = plan->block_count;
+    if (!plan->tag_state)
+    {
+        plan->tag_state = calloc(plan->tag_count ? plan->tag_count : 1, sizeof(TagState)); // publish all tags once
+    }
+    plan->blocks = calloc(plan->tag_count ? plan->tag_count : 1, sizeof(PollBlock));
+    plan->block_count = 0;
+    pthread_mutex_lock(&profile_mutex);
+    plan->profile_version = profile_version;
+    pthread_mutex_unlock(&profile_mutex);
+    plan->latency_version = plan_latency_version(plan);
+
+    PollBlock *block = NULL;
+    for (int t = 0; t < plan->tag_count; t++)
+    {
+        PollTag *tag = &plan->tags[t];
+        int fixed = tag->block_quantity > 0 && tag->block_quantity <= profile_max_read(tag->rtu_id) &&
+                    profile_gap_reads(tag->rtu_id);
+        if (block && block->fixed && block->rtu_id == tag->rtu_id && block->function == tag->function &&
+            block->scan_ms == tag->scan_ms && tag->address >= block->address &&
+            tag->address + tag->quantity <= block->address + block->quantity)
+        {
+            block->tag_count++;
+            continue;
+        }
+        if (block && !block->fixed && !fixed && block->rtu_id == tag->rtu_id && block->function == tag->function &&
+            block->scan_ms == tag->scan_ms) // a recommended block is read as it is, never merged into another
+        {
+            int end = block->address + block->quantity;
+            int merged_start = tag->address < block->address ? tag->address : block->address; // template tag sorts by its block
+            int merged_end = tag->address + tag->quantity > end ? tag->address + tag->quantity : end;
+            int merged = merged_end - merged_start;
+            int gap = tag->address > end ? tag->address - end : 0;
+            if (merged <= profile_max_read(tag->rtu_id) && (gap == 0 || profile_gap_reads(tag->rtu_id)) &&
+                (!port || read_cost_ms(port, tag->rtu_id, merged) <= read_cost_ms(port, tag->rtu_id, block->quantity) + read_cost_ms(port, tag->rtu_id, tag->quantity)))
+            {
+                block->address = merged_start;
+                block->quantity = merged;
+                block->gap_registers += gap;
+                block->tag_count++;
+                continue;
+            }
+        }
+        if (tag->quantity > profile_max_read(tag->rtu_id))
+        {
+            printf("[RTU Server polling] Tag %d reads %d registers, RTU_ID %d reads max %d !!!\n",
+                   tag->tag_id, tag->quantity, tag->rtu_id, profile_max_read(tag->rtu_id));
+        }
+        block = &plan->blocks[plan->block_count++];
+        block->rtu_id = tag->rtu_id;
+        block->function = tag->function;
+        block->address = tag->address;
+        block->quantity = tag->quantity;
+        block->scan_ms = tag->scan_ms;
+        block->tag_count = 1;
+        block->first_tag = t;
+        block->gap_registers = 0;
+        block->fixed = fixed;
+        if (block->fixed) // slave reads less or no gaps -> merge its tags as above
+        {
+            block->address = tag->block_address;
+            block->quantity = tag->block_quantity;
+        }
+    }
+
+    // a block read as before keeps its phase and last read: no jump in the schedule, no publish of
+    // unchanged tags. Others get a spread start phase: block b starts at b/count of its period
+    int layout_changed = tags_changed || plan->block_count != old_count;
+    long long now = now_ms();
+    for (int b = 0; b < plan->block_count; b++)
+    {
+        PollBlock *block = &plan->blocks[b];
+        PollBlock *old = NULL;
+        for (int o = 0; o < old_count && !old; o++)
+        {
+            if (old_blocks[o].last && old_blocks[o].rtu_id == block->rtu_id && old_blocks[o].function == block->function &&
+                old_blocks[o].address == block->address && old_blocks[o].quantity == block->quantity &&
+                old_blocks[o].scan_ms == block->scan_ms)
+            {
+                old = &old_blocks[o];
+            }
+        }
+        layout_changed |= !old || old != &old_blocks[b] || old->first_tag != block->first_tag || old->tag_count != block->tag_count;
+        if (old)
+        {
+            block->next_ms = old->next_ms;
+            block->last = old->last;
+            block->valid = old->valid;
+            block->heartbeat_ms = old->heartbeat_ms;
+            old->last = NULL;
+        }
+        else
+        {
+            block->next_ms = now + (long long)block->scan_ms * b / plan->block_count;
+            block->last = malloc(block->quantity * sizeof(uint16_t));
+        }
+    }
+    for (int o = 0; o < old_count; o++)
+    {
+        free(old_blocks[o].last);
+    }
+    free(old_blocks);
+    if (layout_changed)
+    {
+        plan->plan_version++; // block indexes moved: results of reads on the wire are stale
+        printf("[RTU Server polling] %s: %d tags -> %d block reads\n", name, plan->tag_count, plan->block_count);
+    }
+}
+
+//========================= Function: tag of rtu_id polled by serial port or TCP device ===============
+// port and device NULL: polled by any TCP device
+int poll_tag_owned(int rtu_id, SerialPort *port, TcpDevice *device)
+{
+    if (!port && !device)
+    {
+        return route_tcp_device(rtu_id) != NULL;
+    }
+    return route_tcp_device(rtu_id) == device && (!port || route_request(rtu_id) == port);
+}
+
+void poll_tag_append(PollTag **tags, int *count, const PollTag *tag)
+{
+    if (*count % 64 == 0)
+    {
+        *tags = realloc(*tags, (*count + 64) * sizeof(PollTag));
+    }
+    (*tags)[(*count)++] = *tag;
+}
+
+TagType tag_type_parse(const char *text)
+{
+    static const char *names[] = {"raw", "uint16", "int16", "uint32", "int32", "float32"};
+    for (int i = TAG_UINT16; i <= TAG_FLOAT32; i++)
+    {
+        if (text && strcmp(text, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return TAG_RAW;
+}
+
+//========================= Function: tags of devices with a model from the device template library ===
+//  device_template(model, name, function_code, address, data_type, word_swap, scale, deadband, scan_rate_ms)
+//  device_template_block(model, function_code, start_address, quantity, scan_rate_ms)
+// device_info.device_model picks the template. RTU ID: rtu_route of the TCP device, unit_id of a serial
+// slave found by discovery if rtu_route routes it to the port of the slave. Tag of template address a is tcp address tcp_base_address + a. A tag inside a
+// recommended block is read by it at the scan rate of the block. Tables missing -> no template tags.
+void load_template_tags(sqlite3 *db, PollTag **tags, int *count, SerialPort *port, TcpDevice *device)
+{
+    const char *sql = "SELECT COALESCE(r.rtu_id, s.rtu_id), COALESCE(d.tcp_base_address, 0), t.name, t.function_code, "
+                      "t.address, t.data_type, t.word_swap, t.scale, t.deadband, t.scan_rate_ms, "
+                      "b.start_address, b.quantity, b.scan_rate_ms, d.id, d.unit_id, d.port_id "
+                      "FROM device_info d JOIN device_template t ON t.model = d.device_model "
+                      "LEFT JOIN rtu_route r ON r.device_id = d.id "
+                      "LEFT JOIN rtu_route s ON s.rtu_id = d.unit_id AND s.port_id = d.port_id AND s.device_id IS NULL "
+                      "LEFT JOIN device_template_block b ON b.rowid = (SELECT rowid FROM device_template_block "
+                      "WHERE model = t.model AND function_code = t.function_code AND start_address <= t.address "
+                      "AND t.address < start_address + quantity ORDER BY start_address LIMIT 1) "
+                      "WHERE r.rtu_id IS NOT NULL OR d.port_id IS NOT NULL ORDER BY d.id";
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return;
+    }
+    int skipped_device = -1;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        int rtu_id = sqlite3_column_int(stmt, 0);
+        int port_id = sqlite3_column_int(stmt, 15);
+        if (sqlite3_column_type(stmt, 15) != SQLITE_NULL && (sqlite3_column_type(stmt, 0) == SQLITE_NULL ||
+            route_tcp_device(rtu_id) || route_request(rtu_id)->port_id != port_id))
+        {
+            // serial slave whose unit_id has no rtu_route to its port, in the table or since start
+            if (port && port->port_id == port_id && skipped_device != sqlite3_column_int(stmt, 13))
+            {
+                skipped_device = sqlite3_column_int(stmt, 13);
+                printf("[RTU Server polling] Device %d: RTU_ID %d is not routed to port %d, template tags skipped !!!\n",
+                       skipped_device, sqlite3_column_int(stmt, 14), port_id);
+            }
+            continue;
+        }
+        PollTag tag;
+        memset(&tag, 0, sizeof(tag)); // compared with memcmp, padding included
+        tag.rtu_id = rtu_id;
+        const char *name = (const char *)sqlite3_column_text(stmt, 2);
+        snprintf(tag.name, sizeof(tag.name), "%s", name ? name : "");
+        tag.function = sqlite3_column_type(stmt, 3) == SQLITE_NULL ? 3 : sqlite3_column_int(stmt, 3);
+        tag.address = sqlite3_column_int(stmt, 4);
+        tag.tag_id = sqlite3_column_int(stmt, 1) + tag.address;
+        tag.type = sqlite3_column_type(stmt, 5) == SQLITE_NULL ? TAG_UINT16 : tag_type_parse((const char *)sqlite3_column_text(stmt, 5));
+        tag.quantity = tag.type == TAG_UINT32 || tag.type == TAG_INT32 || tag.type == TAG_FLOAT32 ? 2 : 1;
+        tag.word_swap = sqlite3_column_int(stmt, 6);
+        tag.scale = sqlite3_column_type(stmt, 7) == SQLITE_NULL ? 1 : sqlite3_column_double(stmt, 7);
+        tag.deadband = sqlite3_column_double(stmt, 8);
+        tag.scan_ms = sqlite3_column_type(stmt, 9) == SQLITE_NULL ? POLL_SCAN_MS : sqlite3_column_int(stmt, 9);
+        tag.max_silence_ms = TAG_MAX_SILENCE_MS;
+        if (sqlite3_column_type(stmt, 10) != SQLITE_NULL &&
+            tag.address + tag.quantity <= sqlite3_column_int(stmt, 10) + sqlite3_column_int(stmt, 11))
+        {
+            tag.block_address = sqlite3_column_int(stmt, 10);
+            tag.block_quantity = sqlite3_column_int(stmt, 11);
+            if (sqlite3_column_type(stmt, 12) != SQLITE_NULL)
+            {
+                tag.scan_ms = sqlite3_column_int(stmt, 12);
+            }
+        }
+        if (tag.rtu_id < 1 || tag.rtu_id >= MAX_SLAVES || !poll_tag_owned(tag.rtu_id, port, device))
+        {
+            continue;
+        }
+        if ((tag.function != 3 && tag.function != 4) || tag.type == TAG_RAW || tag.scan_ms < POLL_MIN_SCAN_MS ||
+            tag.block_quantity > 125)
+        {
+            printf("[RTU Server polling] Template tag %s skipped: RTU_ID %d function %d type %s scan %d ms !!!\n",
+                   tag.name, tag.rtu_id, tag.function, sqlite3_column_text(stmt, 5), tag.scan_ms);
+            continue;
+        }
+        poll_tag_append(tags, count, &tag);
+    }
+    sqlite3_finalize(stmt);
+}
+
+//========================= Function: read polled tags of serial port or TCP device, sorted ==========
+// one of port / device is NULL, both NULL: tags of all TCP devices. Return -1 if get_data can not be read
+int read_poll_tags(sqlite3 *db, SerialPort *port, TcpDevice *device, PollTag **result)
+{
+    const char *sql = "SELECT tcp_address, rtu_id, function_code, start_address, quantity, scan_rate_ms, "
+                      "deadband, deadband_percent, max_silence_ms "
+                      "FROM get_data WHERE rtu_id IS NOT NULL";
+    const char *old_sql = "SELECT tcp_address, rtu_id, function_code, start_address, quantity, scan_rate_ms "
+                          "FROM get_data WHERE rtu_id IS NOT NULL"; // get_data without deadband columns
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK &&
+        sqlite3_prepare_v2(db, old_sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return -1; // old get_data without rtu_id/scan_rate_ms -> no polling
+    }
+    PollTag *tags = NULL;
+    int count = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        PollTag tag = {0};
+        tag.tag_id = sqlite3_column_int(stmt, 0);
+        tag.rtu_id = sqlite3_column_int(stmt, 1);
+        tag.function = sqlite3_column_int(stmt, 2);
+        tag.address = sqlite3_column_int(stmt, 3);
+        tag.quantity = sqlite3_column_int(stmt, 4);
+        tag.scan_ms = sqlite3_column_type(stmt, 5) == SQLITE_NULL ? POLL_SCAN_MS : sqlite3_column_int(stmt, 5);
+        tag.deadband = sqlite3_column_double(stmt, 6); // 0 (any change) if column missing or NULL
+        tag.deadband_percent = sqlite3_column_int(stmt, 7);
+        tag.max_silence_ms = sqlite3_column_type(stmt, 8) == SQLITE_NULL ? TAG_MAX_SILENCE_MS : sqlite3_column_int(stmt, 8);
+        if (tag.rtu_id < 1 || tag.rtu_id >= MAX_SLAVES || !poll_tag_owned(tag.rtu_id, port, device))
+        {
+            continue;
+        }
+        if ((tag.function != 3 && tag.function != 4) || tag.quantity < 1 || tag.quantity > 125 || tag.scan_ms < POLL_MIN_SCAN_MS)
+        {
+            printf("[RTU Server polling] Tag %d skipped: RTU_ID %d function %d quantity %d scan %d ms !!!\n",
+                   tag.tag_id, tag.rtu_id, tag.function, tag.quantity, tag.scan_ms);
+            continue;
+        }
+        poll_tag_append(&tags, &count, &tag);
+    }
+    sqlite3_finalize(stmt);
+    load_template_tags(db, &tags, &count, port, device);
+
+    if (count > 0)
+    {
+        qsort(tags, count, sizeof(PollTag), compare_poll_tag);
+    }
+    *result = tags;
+    return count;
+}
+
+//========================= Function: take tags of serial port or TCP device, compile if changed =====
+// all: sorted tags read by read_poll_tags, tags of other ports / devices are left out
+void poll_plan_set_tags(PollPlan *plan, const PollTag *all, int all_count, SerialPort *port, TcpDevice *device)
+{
+    PollTag *tags = NULL;
+    int count = 0;
+    for (int i = 0; i < all_count; i++)
+    {
+        if (poll_tag_owned(all[i].rtu_id, port, device))
+        {
+            poll_tag_append(&tags, &count, &all[i]);
+        }
+    }
+    if (count == plan->tag_count && (count == 0 || memcmp(tags, plan->tags, count * sizeof(PollTag)) == 0))
+    {
+        free(tags); // other table changed, keep plan and phases
+        return;
+    }
+    // tags that stay keep their report by exception state, new ones are published once
+    TagState *state = calloc(count ? count : 1, sizeof(TagState));
+    for (int t = 0, o = 0; t < count && plan->tag_state; t++)
+    {
+        while (o < plan->tag_count && compare_poll_tag(&plan->tags[o], &tags[t]) < 0)
+        {
+            o++;
+        }
+        if (o < plan->tag_count && memcmp(&plan->tags[o], &tags[t], sizeof(PollTag)) == 0)
+        {
+            state[t] = plan->tag_state[o++];
+        }
+    }
+    free(plan->tag_state);
+    plan->tag_state = state;
+    free(plan->tags);
+    plan->tags = tags;
+    plan->tag_count = count;
+    poll_plan_compile(plan, port, port ? port->device : device->ip, 1);
+}
+
+//========================= Function: load tags of serial port or TCP device, compile if changed ======
+void load_poll_tags(sqlite3 *db, PollPlan *plan, SerialPort *port, TcpDevice *device)
+{
+    PollTag *tags = NULL;
+    int count = read_poll_tags(db, port, device, &tags);
+    if (count >= 0)
+    {
+        poll_plan_set_tags(plan, tags, count, port, device);
+    }
+    free(tags);
+}
+
+//========================= Function: PRAGMA data_version ============================================
+// changes when another connection commits, call often, it is cheap
+int database_version(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &stmt, NULL) == SQLITE_OK)
+    {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            version = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return version;
+}
+
+//========================= Function: compile poll plan again when profiles or latency changed ======
+void poll_plan_recheck(PollPlan *plan, SerialPort *port, TcpDevice *device)
+{
+    pthread_mutex_lock(&profile_mutex);
+    int profile_changed = plan->profile_version != profile_version;
+    pthread_mutex_unlock(&profile_mutex);
+    int latency_changed = port && plan->latency_version != plan_latency_version(plan); // TCP plans do not use it
+    // slave refused a block read or its response time moved: compile with new limits and costs
+    if ((profile_changed || latency_changed) && plan->tag_count > 0)
+    {
+        poll_plan_compile(plan, port, port ? port->device : device->ip, 0);
+    }
+}
+
+//========================= Function: reload poll plan when database changed =========================
+void poll_plan_refresh(sqlite3 *db, PollPlan *plan, SerialPort *port, TcpDevice *device)
+{
+    int version = database_version(db);
+    if (version != plan->data_version)
+    {
+        plan->data_version = version;
+        load_poll_tags(db, plan, port, device);
+    }
+    poll_plan_recheck(plan, port, device);
+}
+
+//========================= Function: due poll block with earliest deadline ==========================
+// deadline of a block = end of its scan period. Blocks whose period passed without a read are
+// counted as missed and move to the next period. Return NULL and lower *wake_ms if none is due.
+PollBlock *poll_due(SerialPort *port, long long *wake_ms)
+{
+    long long now = now_ms();
+    PollBlock *due = NULL;
+    for (int b = 0; b < port->plan.block_count; b++)
+    {
+        PollBlock *block = &port->plan.blocks[b];
+        while (block->next_ms + block->scan_ms <= now) // expired, never reached the wire
+        {
+            block->next_ms += block->scan_ms;
+            port->missed_polls++;
+        }
+        if (block->next_ms > now)
+        {
+            *wake_ms = block->next_ms < *wake_ms ? block->next_ms : *wake_ms;
+            continue;
+        }
+
+        RequestPacket probe = {0};
+        probe.transaction_id = POLL_TRANSACTION_ID;
+        probe.rtu_id = block->rtu_id;
+        probe.function = block->function;
+        probe.address = block->address;
+        probe.quantity = block->quantity;
+        if (!breaker_allow(&probe))
+        {
+            block->next_ms += block->scan_ms; // slave down, skip this cycle
+            continue;
+        }
+        long long wait = token_wait(block->rtu_id);
+        if (wait > 0)
+        {
+            *wake_ms = now + wait < *wake_ms ? now + wait : *wake_ms;
+            continue;
+        }
+        if (!due || block->next_ms + block->scan_ms < due->next_ms + due->scan_ms)
+        {
+            due = block;
+        }
+    }
+    return due;
+}
+
+//========================= Function: request for poll block, next read in next scan period ===========
+void poll_fill_request(PollPlan *plan, PollBlock *block, RequestPacket *req)
+{
+    memset(req, 0, sizeof(RequestPacket));
+    req->transaction_id = POLL_TRANSACTION_ID;
+    req->rtu_id = block->rtu_id;
+    req->address = block->address;
+    req->function = block->function;
+    req->quantity = block->quantity;
+    req->deadline_ms = block->next_ms + block->scan_ms;
+    req->poll_block = block - plan->blocks;
+    req->plan_version = plan->plan_version;
+    req->read_gaps = block->gap_registers > 0;
+    block->next_ms += block->scan_ms; // keep phase
+}
+
+void poll_request(SerialPort *port, PollBlock *block, RequestPacket *req)
+{
+    poll_fill_request(&port->plan, block, req);
+    take_token(block->rtu_id);
+    port->sent_polls++;
+}
+
+//========================= Function: compare registers of block with last read ======================
+// dirty: bitmap of changed registers (bit i = register i). 8 registers are compared at once
+// (SSE2 / NEON with GCC vector extensions), unchanged groups cost one compare.
+typedef uint16_t RegisterVector __attribute__((vector_size(16)));
+
+int poll_diff(const uint16_t *last, const uint16_t *value, int count, uint64_t *dirty)
+{
+    int changed = 0;
+    dirty[0] = dirty[1] = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        RegisterVector a, b;
+        memcpy(&a, last + i, sizeof(a));
+        memcpy(&b, value + i, sizeof(b));
+        RegisterVector ne = a != b; // 0xFFFF where register changed
+        uint64_t half[2];
+        memcpy(half, &ne, sizeof(half));
+        if ((half[0] | half[1]) == 0)
+        {
+            continue;
+        }
+        for (int j = 0; j < 8; j++)
+        {
+            if (ne[j])
+            {
+                dirty[(i + j) / 64] |= 1ULL << ((i + j) % 64);
+                changed++;
+            }
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (last[i] != value[i])
+        {
+            dirty[i / 64] |= 1ULL << (i % 64);
+            changed++;
+        }
+    }
+    return changed;
+}
+
+//========================= Function: 1 if a bit of dirty[first..first+count) is set =================
+int poll_dirty(const uint64_t *dirty, int first, int count)
+{
+    for (int i = first; i < first + count; i++)
+    {
+        if (i % 64 == 0 && i + 64 <= first + count)
+        {
+            if (dirty[i / 64])
+            {
+                return 1;
+            }
+            i += 63;
+        }
+        else if (dirty[i / 64] & (1ULL << (i % 64)))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//========================= Function: value of typed tag (device template) from its registers ========
+// 32-bit types: high word first (Modbus order), word_swap low word first
+double tag_scaled_value(TagType type, int word_swap, double scale, const uint16_t *value)
+{
+    uint32_t bits = word_swap ? (uint32_t)value[1] << 16 | value[0] : (uint32_t)value[0] << 16 | value[1];
+    double typed;
+    float real;
+    switch (type)
+    {
+    case TAG_INT16:
+        typed = (int16_t)value[0];
+        break;
+    case TAG_UINT32:
+        typed = bits;
+        break;
+    case TAG_INT32:
+        typed = (int32_t)bits;
+        break;
+    case TAG_FLOAT32:
+        memcpy(&real, &bits, sizeof(real));
+        typed = real;
+        break;
+    default:
+        typed = value[0];
+        break;
+    }
+    return typed * scale;
+}
+
+//========================= Function: 1 if tag moved out of its deadband since last publish =========
+// typed tag: deadband of its value, get_data tag: of each register
+int tag_outside_deadband(const PollTag *tag, const TagState *state, const uint16_t *value)
+{
+    if (tag->type != TAG_RAW)
+    {
+        double published = tag_scaled_value(tag->type, tag->word_swap, tag->scale, state->value);
+        double limit = tag->deadband_percent ? tag->deadband * fabs(published) / 100 : tag->deadband;
+        double moved = fabs(tag_scaled_value(tag->type, tag->word_swap, tag->scale, value) - published);
+        return moved > limit || (limit == 0 && memcmp(value, state->value, tag->quantity * sizeof(uint16_t)) != 0);
+    }
+    for (int i = 0; i < tag->quantity; i++)
+    {
+        double published = state->value[i];
+        double limit = tag->deadband_percent ? tag->deadband * fabs(published) / 100 : tag->deadband;
+        if (fabs(value[i] - published) > limit)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//========================= Function: report by exception, queue tags of block that changed ==========
+// fast path: registers equal to the last read of the block are skipped without looking at tags
+void poll_publish(PollPlan *plan, PollBlock *block, const uint16_t *value)
+{
+    uint64_t dirty[2];
+    int changed = block->valid ? poll_diff(block->last, value, block->quantity, dirty) : block->quantity;
+    if (!block->valid)
+    {
+        dirty[0] = dirty[1] = ~0ULL;
+    }
+    memcpy(block->last, value, block->quantity * sizeof(uint16_t));
+    block->valid = 1;
+
+    long long now = now_ms();
+    if (changed == 0 && now < block->heartbeat_ms)
+    {
+        return; // nothing changed and no tag silent too long
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    block->heartbeat_ms = now + 24LL * 3600 * 1000;
+    for (int t = block->first_tag; t < block->first_tag + block->tag_count; t++)
+    {
+        PollTag *tag = &plan->tags[t];
+        TagState *state = &plan->tag_state[t];
+        int offset = tag->address - block->address;
+        const uint16_t *tag_value = value + offset;
+
+        int silent = tag->max_silence_ms > 0 && now - state->published_ms >= tag->max_silence_ms;
+        if (state->published_ms == 0 || silent ||
+            (poll_dirty(dirty, offset, tag->quantity) && tag_outside_deadband(tag, state, tag_value)))
+        {
+            TagUpdate update;
+            update.tag_id = tag->tag_id;
+            update.rtu_id = tag->rtu_id;
+            update.function = tag->function;
+            update.address = tag->address;
+            update.quantity = tag->quantity;
+            update.time_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+            memcpy(update.value, tag_value, tag->quantity * sizeof(uint16_t));
+            memcpy(update.name, tag->name, sizeof(update.name));
+            update.type = tag->type;
+            update.word_swap = tag->word_swap;
+            update.scale = tag->scale;
+            tag_update_add(&update);
+            for (int i = 0; i < tag->quantity; i++)
+            {
+                data_log_add(tag->rtu_id, tag->address + i, tag_value[i]);
+            }
+            memcpy(state->value, tag_value, tag->quantity * sizeof(uint16_t));
+            state->published_ms = now;
+        }
+        if (tag->max_silence_ms > 0 && state->published_ms + tag->max_silence_ms < block->heartbeat_ms)
+        {
+            block->heartbeat_ms = state->published_ms + tag->max_silence_ms;
+        }
+    }
+}
+
+//========================= Function: save result of poll in value cache, publish changes ============
+void poll_done(const RequestPacket *req, int rc, const uint16_t *value)
+{
+    if (rc == -1)
+    {
+        printf("[RTU Server polling] RTU_ID %d address %d failed !!!\n", req->rtu_id, req->address);
+        return;
+    }
+    for (int i = 0; i < rc; i++)
+    {
+        cache_store(req->rtu_id, req->function, req->address + i, value[i]);
+    }
+    TcpDevice *device = route_tcp_device(req->rtu_id);
+    PollPlan *plan = device ? &device->plan : &route_request(req->rtu_id)->plan;
+    if (req->plan_version == plan->plan_version && req->poll_block < plan->block_count) // plan not compiled again meanwhile
+    {
+        poll_publish(plan, &plan->blocks[req->poll_block], value);
+    }
+}
+
+//====================================================================================================
+//========================= Split reads: client read larger than max read of the slave ===============
+//  the scheduler sends the parts as separate reads (same deadline, in address order) and answers the
+//  client once when the last part is finished. A failed part fails the whole read.
+#define SPLIT_READS 16 // split client reads in flight
+#define SPLIT_PENDING -2
+
+typedef struct
+{
+    int used;
+    int transaction_id;
+    int rtu_id;
+    long long deadline_ms; // entry is free after this, parts may have expired in pending
+    int parts;             // parts not finished yet
+    int status;            // exception code of first failed part, 0 if all answered
+    uint16_t value[MAX_READ_REGISTERS];
+} SplitRead;
+SplitRead split_reads[SPLIT_READS];
+pthread_mutex_t split_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//========================= Function: put read into pending as parts of max read registers ===========
+// return 1 if split, 0 if the read fits the slave or cannot be split (no room)
+int split_read(SerialPort *port, const RequestPacket *req)
+{
+    int max_read = profile_max_read(req->rtu_id);
+    if ((req->function != 3 && req->function != 4) || req->quantity <= max_read || req->transaction_id < 0)
+    {
+        return 0;
+    }
+    int parts = (req->quantity + max_read - 1) / max_read;
+    if (port->pending_count + parts > MAX_QUEUE)
+    {
+        return 0;
+    }
+    long long now = now_ms();
+    pthread_mutex_lock(&split_mutex);
+    SplitRead *split = NULL;
+    for (int i = 0; i < SPLIT_READS && !split; i++)
+    {
+        if (!split_reads[i].used || split_reads[i].deadline_ms < now)
+        {
+            split = &split_reads[i];
+        }
+    }
+    if (split)
+    {
+        split->used = 1;
+        split->transaction_id = req->transaction_id;
+        split->rtu_id = req->rtu_id;
+        split->deadline_ms = req->deadline_ms;
+        split->parts = parts;
+        split->status = 0;
+    }
+    pthread_mutex_unlock(&split_mutex);
+    if (!split)
+    {
+        return 0;
+    }
+    for (int offset = 0; offset < req->quantity; offset += max_read)
+    {
+        RequestPacket *part = &port->pending[port->pending_count++];
+        *part = *req;
+        part->address = req->address + offset;
+        part->quantity = req->quantity - offset < max_read ? req->quantity - offset : max_read;
+        part->split_offset = offset;
+        part->split_quantity = req->quantity;
+    }
+    printf("[RTU Server scheduler] Read of %d registers transaction_id %d split into %d reads (RTU_ID %d reads max %d).\n",
+           req->quantity, req->transaction_id, parts, req->rtu_id, max_read);
+    return 1;
+}
+
+//========================= Function: result of one part of a split read =============================
+// return SPLIT_PENDING while other parts run, else rc of the whole read (*whole, registers in joined,
+// *whole_err = MODBUS_ENOBASE + exception code if failed)
+int split_join(const RequestPacket *part, int rc, const uint16_t *value, int err, RequestPacket *whole,
+               uint16_t *joined, int *whole_err)
+{
+    int result = SPLIT_PENDING;
+    pthread_mutex_lock(&split_mutex);
+    for (int i = 0; i < SPLIT_READS; i++)
+    {
+        SplitRead *split = &split_reads[i];
+        if (!split->used || split->transaction_id != part->transaction_id || split->rtu_id != part->rtu_id)
+        {
+            continue;
+        }
+        if (rc != -1)
+        {
+            memcpy(split->value + part->split_offset, value, part->quantity * sizeof(uint16_t));
+        }
+        else if (split->status == 0)
+        {
+            split->status = err > MODBUS_ENOBASE && err < MODBUS_ENOBASE + 0x20 ? err - MODBUS_ENOBASE : EXCEPTION_TARGET_NO_RESPONSE;
+        }
+        if (--split->parts == 0)
+        {
+            *whole = *part;
+            whole->address = part->address - part->split_offset;
+            whole->quantity = part->split_quantity;
+            whole->split_offset = 0;
+            whole->split_quantity = 0;
+            memcpy(joined, split->value, whole->quantity * sizeof(uint16_t));
+            *whole_err = MODBUS_ENOBASE + split->status;
+            result = split->status ? -1 : whole->quantity;
+            split->used = 0;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&split_mutex);
+    return result;
+}
+
+//====================================================================================================
+//========================= Function: answer request with exception code without sending it =========
+void fail_request(const RequestPacket *req, int status)
+{
+    if (req->transaction_id < 0) // probe or poll
+    {
+        return;
+    }
+    RequestPacket whole;
+    if (req->split_quantity) // part of split read: the client gets one answer for all parts
+    {
+        uint16_t joined[MAX_READ_REGISTERS];
+        int err;
+        if (split_join(req, -1, NULL, MODBUS_ENOBASE + status, &whole, joined, &err) == SPLIT_PENDING)
+        {
+            return;
+        }
+        req = &whole;
+        status = err - MODBUS_ENOBASE;
+    }
+    ResponsePacket resp = {0};
+    resp.transaction_id = req->transaction_id;
+    resp.rtu_id = req->rtu_id;
+    resp.address = req->address;
+    resp.function = req->function;
+    resp.status = status;
+    if (req->write_function) // merged FC23: answer the read and the write
+    {
+        ResponsePacket read = resp;
+        read.transaction_id = req->read_transaction_id;
+        read.function = 3;
+        add_response(read);
+        resp.function = req->write_function;
+        resp.address = req->write_address;
+    }
+    add_response(resp);
+}
+
+//========================= Function: schedule retry of a failed read on the same port ===============
+// the retry waits in pending like a client request: other requests and polls use the bus for
+// retry_gap_ms, then it competes with its original deadline. A merged FC23 refused with exception
+// 0x01 goes back as the write and the read it was made of. return 1 if the request was rescheduled
+int retry_request(SerialPort *port, const RequestPacket *req, int rc, int err)
+{
+    if (rc == -1 && err == EMBXILFUN && req->write_function && port->pending_count + 2 <= MAX_QUEUE)
+    {
+        // in front of later requests: equal deadlines go in pending order, the write must stay first
+        memmove(&port->pending[2], &port->pending[0], port->pending_count * sizeof(RequestPacket));
+        port->pending_count += 2;
+        RequestPacket *write = &port->pending[0];
+        RequestPacket *read = &port->pending[1];
+        *write = *req;
+        write->function = req->write_function;
+        write->address = req->write_address;
+        write->quantity = req->write_function == 6 ? 1 : req->write_quantity;
+        write->write_function = 0;
+        write->read_transaction_id = 0;
+        write->attempt++; // not merged again
+        memset(read, 0, sizeof(RequestPacket));
+        read->transaction_id = req->read_transaction_id;
+        read->rtu_id = req->rtu_id;
+        read->function = 3;
+        read->address = req->address;
+        read->quantity = req->quantity;
+        read->deadline_ms = req->deadline_ms;
+        printf("[RTU Server scheduler] RTU_ID %d refused FC23, write transaction_id %d and read transaction_id %d sent again.\n",
+               req->rtu_id, write->transaction_id, read->transaction_id);
+        return 1;
+    }
+    int gap_ms;
+    if (rc != -1 || port_fault(err) || !retry_allowed(req, err, &gap_ms) || port->pending_count >= MAX_QUEUE)
+    {
+        return 0;
+    }
+    long long now = now_ms();
+    if (now + gap_ms + slave_timeout_ms(req->rtu_id) > req->deadline_ms)
+    {
+        return 0; // no time left for another attempt
+    }
+    RequestPacket *retry = &port->pending[port->pending_count++];
+    *retry = *req;
+    retry->attempt++;
+    retry->not_before_ms = now + gap_ms;
+    port->retries++;
+    printf("[RTU Server retry] RTU_ID %d transaction_id %d: %s, retry %d in %d ms.\n", req->rtu_id, req->transaction_id,
+           modbus_strerror(err), retry->attempt, gap_ms);
+    return 1;
+}
+
+//========================= Function: merge write with following read of the same slave into FC23 ===
+// write: FC6 / FC16 just taken from pending, next: index in pending of the requests that came after
+// it. Only the first later request to the slave is looked at, so writes and reads keep their order.
+void merge_write_read(SerialPort *port, RequestPacket *write, int next)
+{
+    if (write->attempt > 0 || write->write_quantity > MAX_WRITE_READ_REGISTERS || !profile_supports(write->rtu_id, 23))
+    {
+        return;
+    }
+    long long now = now_ms();
+    for (int i = next; i < port->pending_count; i++)
+    {
+        RequestPacket *read = &port->pending[i];
+        if (read->rtu_id != write->rtu_id)
+        {
+            continue;
+        }
+        if (read->function != 3 || read->transaction_id < 0 || read->attempt > 0 || read->split_quantity ||
+            read->deadline_ms - slave_timeout_ms(read->rtu_id) <= now)
+        {
+            return;
+        }
+        write->write_function = write->function;
+        write->function = 23;
+        write->read_transaction_id = read->transaction_id;
+        write->address = read->address;
+        write->quantity = read->quantity;
+        write->deadline_ms = read->deadline_ms < write->deadline_ms ? read->deadline_ms : write->deadline_ms;
+        memmove(read, read + 1, (port->pending_count - i - 1) * sizeof(RequestPacket));
+        port->pending_count--;
+        port->merged_requests++;
+        printf("[RTU Server scheduler] Write transaction_id %d and read transaction_id %d sent as FC23.\n",
+               write->transaction_id, write->read_transaction_id);
+        return;
+    }
+}
+
+//====================================================================================================
+//========================= Slave discovery (Redis channel modbus_discovery) =========================
+//  start: PUBLISH modbus_discovery '{"first": 1, "last": 247, "method": "report_slave_id"}'
+//    method "read": FC3 of one register at "address" (default 0) instead of report slave id (FC17)
+//    "port_id": scan one port only (default all ports at once), "timeout_ms": first probe timeout
+//  each port sends probes when it has nothing else to do: clients and polls go first. Any answer,
+//  also an exception response, means the id is used. Probe timeout is short and follows the
+//  slowest answer on the port. Found slaves go to device_info, progress to Redis key modbus_discovery:rtu
+void discovery_start(const json_t *cmd)
+{
+    json_t *port_id = json_object_get(cmd, "port_id");
+    json_t *timeout = json_object_get(cmd, "timeout_ms");
+    const char *method = json_string_value(json_object_get(cmd, "method"));
+    int first = json_object_get(cmd, "first") ? json_integer_value(json_object_get(cmd, "first")) : 1;
+    int last = json_object_get(cmd, "last") ? json_integer_value(json_object_get(cmd, "last")) : 247;
+
+    pthread_mutex_lock(&discovery_mutex);
+    for (int i = 0; i < port_count; i++)
+    {
+        SerialPort *port = &serial_ports[i];
+        if (port_id && json_integer_value(port_id) != port->port_id)
+        {
+            continue;
+        }
+        Discovery *d = &port->discovery;
+        int inflight = d->state == DISCOVERY_RUNNING && d->inflight; // answer of old probe still counts
+        memset(d, 0, sizeof(Discovery));
+        d->state = DISCOVERY_RUNNING;
+        d->first_id = clamp_int(first, 1, MAX_SLAVES - 1);
+        d->last_id = clamp_int(last, d->first_id, MAX_SLAVES - 1);
+        d->next_id = d->first_id;
+        d->function = method && strcmp(method, "read") == 0 ? 3 : 17;
+        d->address = clamp_int(json_integer_value(json_object_get(cmd, "address")), 0, 0xFFFF);
+        d->initial_timeout_ms = timeout ? clamp_int(json_integer_value(timeout), DISCOVERY_TIMEOUT_MIN_MS, RESPONSE_TIMEOUT_MS)
+                                        : DISCOVERY_TIMEOUT_MS + (int)frame_time_ms(port, 8 + 5 + DISCOVERY_ID_BYTES);
+        d->timeout_ms = d->initial_timeout_ms;
+        d->inflight = inflight;
+        d->started_ms = now_ms();
+        printf("[RTU Server discovery] Scan of %s: ids %d..%d, function %d, timeout %d ms.\n",
+               port->device, d->first_id, d->last_id, d->function, d->timeout_ms);
+        wake_queue(&port->queue);
+    }
+    pthread_mutex_unlock(&discovery_mutex);
+}
+
+//========================= Function: next discovery probe of port, 1 if *req was filled ===========
+int discovery_take_probe(SerialPort *port, RequestPacket *req)
+{
+    pthread_mutex_lock(&discovery_mutex);
+    Discovery *d = &port->discovery;
+    int take = d->state == DISCOVERY_RUNNING && !d->inflight && d->next_id <= d->last_id;
+    if (take)
+    {
+        memset(req, 0, sizeof(RequestPacket));
+        req->transaction_id = DISCOVERY_TRANSACTION_ID;
+        req->rtu_id = d->next_id++;
+        req->function = d->function;
+        req->address = d->address;
+        req->quantity = 1;
+        req->deadline_ms = now_ms() + RESPONSE_TIMEOUT_MS;
+        req->discovery_port = port - serial_ports;
+        d->inflight = 1;
+        d->probe_ms = now_ms();
+    }
+    pthread_mutex_unlock(&discovery_mutex);
+    return take;
+}
+
+//========================= Function: response timeout of request on port ============================
+int request_timeout_ms(const SerialPort *port, const RequestPacket *req)
+{
+    if (req->transaction_id != DISCOVERY_TRANSACTION_ID)
+    {
+        return slave_timeout_ms(req->rtu_id);
+    }
+    pthread_mutex_lock(&discovery_mutex);
+    int timeout = port->discovery.timeout_ms;
+    pthread_mutex_unlock(&discovery_mutex);
+    return timeout;
+}
+
+//========================= Function: result of discovery probe ======================================
+// rc: data bytes of report slave id in value (one byte per value) or registers read, -1 with errno err
+void discovery_done(const RequestPacket *req, int rc, const uint16_t *value, int err)
+{
+    pthread_mutex_lock(&discovery_mutex);
+    SerialPort *port = &serial_ports[req->discovery_port];
+    Discovery *d = &port->discovery;
+    if (d->state == DISCOVERY_RUNNING && d->inflight)
+    {
+        d->inflight = 0;
+        d->probed++;
+        if (rc != -1 || (err >= EMBXILFUN && err <= EMBXGTAR)) // data or exception response of this slave
+        {
+            double ms = now_ms() - d->probe_ms;
+            d->found[req->rtu_id] = 1;
+            d->found_count++;
+            d->response_ms[req->rtu_id] = ms;
+            int len = req->function == 17 && rc > 0 ? (rc < DISCOVERY_ID_BYTES ? rc : DISCOVERY_ID_BYTES) : 0;
+            for (int i = 0; i < len; i++)
+            {
+                d->slave_id[req->rtu_id][i] = value[i];
+            }
+            d->slave_id_len[req->rtu_id] = len;
+            d->slowest_ms = ms > d->slowest_ms ? ms : d->slowest_ms;
+            d->timeout_ms = clamp_int((int)(3 * d->slowest_ms), DISCOVERY_TIMEOUT_MIN_MS, RESPONSE_TIMEOUT_MS);
+            printf("[RTU Server discovery] RTU_ID %d answered on %s after %.1f ms.\n", req->rtu_id, port->device, ms);
+        }
+        if (d->next_id > d->last_id)
+        {
+            d->state = DISCOVERY_DONE;
+            d->finished_ms = now_ms();
+            printf("[RTU Server discovery] Scan of %s done: %d slaves in %lld ms.\n", port->device, d->found_count,
+                   d->finished_ms - d->started_ms);
+        }
+    }
+    pthread_mutex_unlock(&discovery_mutex);
+}
+
+//====================================================================================================
+//========================= Function: pick next request to send on a serial port =====================
+// earliest deadline first: client requests (deadline from TCP server) and due poll blocks (end of
+// scan period) compete for the bus. Deadlines are compared as latest start time (deadline - response
+// timeout of slave); work that cannot finish in time is dropped before it reaches the wire and counted
+// per port. Client requests over rate limit are answered from cache or wait in pending for a token,
+// retries wait in pending until their gap is over. A write followed by a read of the same slave goes
+// out as one FC23 read/write request, reads larger than the max read of the slave as several reads
+// (device profile). Discovery probes use the time left.
+// return 1 if *req can be sent now, 0 if nothing to send before *wake_ms
+int pick_request(SerialPort *port, RequestPacket *req, long long *wake_ms)
+{
+    long long now = now_ms();
+    *wake_ms = now + 1000;
+    if (breaker_take_probe(port, req, wake_ms))
+    {
+        return 1;
+    }
+
+    RequestPacket in;
+    while (port->pending_count < MAX_QUEUE && try_take_request(&port->queue, &in))
+    {
+        if (!breaker_allow(&in))
+        {
+            fail_request(&in, EXCEPTION_TARGET_NO_RESPONSE); // slave down, fail fast
+            continue;
+        }
+        if (!profile_supports(in.rtu_id, in.function))
+        {
+            fail_request(&in, EXCEPTION_ILLEGAL_FUNCTION); // slave answered 0x01 before, do not ask again
+            continue;
+        }
+        ResponsePacket resp = {0};
+        if (token_wait(in.rtu_id) > 0 &&
+            cache_lookup(in.rtu_id, in.function, in.address, bucket_cache_max_age(in.rtu_id), &resp.value))
+        {
+            resp.transaction_id = in.transaction_id;
+            resp.rtu_id = in.rtu_id;
+            resp.address = in.address;
+            resp.function = in.function;
+            printf("[RTU Server rate limit] RTU_ID %d over limit, transaction_id %d answered from cache.\n", in.rtu_id, in.transaction_id);
+            add_response(resp);
+            continue;
+        }
+        if (split_read(port, &in))
+        {
+            continue;
+        }
+        port->pending[port->pending_count++] = in;
+    }
+
+    int best = -1;
+    long long best_start = 0;
+    for (int i = 0; i < port->pending_count; i++)
+    {
+        RequestPacket *p = &port->pending[i];
+        long long start_by = p->deadline_ms - slave_timeout_ms(p->rtu_id);
+        int expired = start_by <= now;
+        if (expired || !breaker_allow(p))
+        {
+            if (expired)
+            {
+                port->missed_requests++; // the TCP server answers 0x0B at the client's deadline
+                printf("[RTU Server scheduler] Transaction_id %d expired on %s, dropped !!!\n", p->transaction_id, port->device);
+            }
+            else
+            {
+                fail_request(p, EXCEPTION_TARGET_NO_RESPONSE);
+            }
+            memmove(p, p + 1, (port->pending_count - i - 1) * sizeof(RequestPacket));
+            port->pending_count--;
+            i--;
+            continue;
+        }
+        if (p->not_before_ms > now) // retry gap
+        {
+            *wake_ms = p->not_before_ms < *wake_ms ? p->not_before_ms : *wake_ms;
+            continue;
+        }
+        long long wait = token_wait(p->rtu_id);
+        if (wait > 0)
+        {
+            *wake_ms = now + wait < *wake_ms ? now + wait : *wake_ms;
+            continue;
+        }
+        if (best == -1 || start_by < best_start)
+        {
+            best = i;
+            best_start = start_by;
+        }
+    }
+
+    PollBlock *poll = poll_due(port, wake_ms);
+    if (best >= 0 && (!poll || best_start <= poll->next_ms + poll->scan_ms - slave_timeout_ms(poll->rtu_id)))
+    {
+        *req = port->pending[best];
+        memmove(&port->pending[best], &port->pending[best + 1], (port->pending_count - best - 1) * sizeof(RequestPacket));
+        port->pending_count--;
+        take_token(req->rtu_id);
+        if (req->attempt == 0)
+        {
+            port->sent_requests++;
+        }
+        if (req->function == 6 || req->function == 16)
+        {
+            merge_write_read(port, req, best);
+        }
+        return 1;
+    }
+    if (poll)
+    {
+        poll_request(port, poll, req);
+        return 1;
+    }
+    if (discovery_take_probe(port, req))
+    {
+        return 1;
+    }
+    for (int i = 0; i < port->pending_count; i++) // wake up to drop expired requests
+    {
+        long long start_by = port->pending[i].deadline_ms - slave_timeout_ms(port->pending[i].rtu_id);
+        *wake_ms = start_by < *wake_ms ? start_by : *wake_ms;
+    }
+    return 0;
+}
+
+//====================================================================================================
+//========================= Function: send result of a request to response queue =====================
+// rc: number of registers in value (read, or written by FC6 / FC16), -1 if failed with errno err
+// buffer: pool buffer with the registers, NULL if the read used another one; it goes to the response
+// thread with the response or back to the pool
+void finish_request(const RequestPacket *req, int rc, RegisterBuffer *buffer, const uint16_t *value, int err)
+{
+    if (req->transaction_id == PROBE_TRANSACTION_ID)
+    {
+        printf("[RTU Server breaker] Probe of RTU_ID %d %s.\n", req->rtu_id, rc != -1 ? "answered" : "failed");
+        breaker_probe_done(req->rtu_id);
+        buffer_release(buffer);
+        return;
+    }
+    if (req->transaction_id == POLL_TRANSACTION_ID)
+    {
+        poll_done(req, rc, value);
+        buffer_release(buffer);
+        return;
+    }
+    if (req->transaction_id == DISCOVERY_TRANSACTION_ID)
+    {
+        discovery_done(req, rc, value, err);
+        buffer_release(buffer);
+        return;
+    }
+    if (req->split_quantity) // part of split read, answer when all parts are back
+    {
+        RequestPacket whole;
+        uint16_t joined[MAX_READ_REGISTERS];
+        int whole_rc = split_join(req, rc, value, err, &whole, joined, &err);
+        if (whole_rc == SPLIT_PENDING)
+        {
+            buffer_release(buffer);
+            return;
+        }
+        if (buffer && whole_rc > 0)
+        {
+            memcpy(buffer->value, joined, whole_rc * sizeof(uint16_t));
+        }
+        finish_request(&whole, whole_rc, buffer, buffer ? buffer->value : joined, err);
+        return;
+    }
+
+    ResponsePacket resp = {0};
+    resp.transaction_id = req->transaction_id;
+    resp.function = req->function;
+    resp.rtu_id = req->rtu_id;
+    resp.address = req->address;
+
+    // exception response of slave -> same code for client, no response or bad frame -> 0x0B
+    int status = err > MODBUS_ENOBASE && err < MODBUS_ENOBASE + 0x20 ? err - MODBUS_ENOBASE : EXCEPTION_TARGET_NO_RESPONSE;
+    if (req->write_function) // merged FC23: write part gets its own response, the rest answers the read
+    {
+        ResponsePacket write = resp;
+        write.function = req->write_function;
+        write.address = req->write_address;
+        write.status = rc != -1 ? 0 : status;
+        write.value = rc != -1 ? req->write_value[0] : 0;
+        add_response(write);
+        resp.transaction_id = req->read_transaction_id;
+        resp.function = 3;
+    }
+
+    if (rc != -1)
+    {
+        resp.status = 0;
+        resp.value = rc > 0 ? value[0] : 0;
+        resp.buffer = buffer; // no copy, response thread releases it
+        resp.quantity = rc;
+        buffer = NULL;
+        cache_store_written(req);
+        if (rc > 0 && req->write_quantity == 0)
+        {
+            cache_store(req->rtu_id, req->function, req->address, resp.value);
+        }
+        else if (rc > 0 && req->function == 23)
+        {
+            cache_store(req->rtu_id, 3, req->address, resp.value);
+        }
+        printf("[RTU Server get data] Success to get data from RTU_ID: %d with transaction_id: %d .\n", req->rtu_id, resp.transaction_id);
+        printf("[RTU Server get data] data value:  %d .\n", resp.value);
+        // write_log_log("write_log.log", "INFO", "[RTU Server get data] Success to get data from RTU_ID: %d with transaction_id: %d . Value: %d", req.rtu_id, resp.transaction_id, resp.value);
+    }
+    else
+    {
+        resp.status = status;
+        resp.value = 0;
+        printf("[RTU Server get data] Transaction_id %d failed to get data from device, try again !!!\n", req->transaction_id);
+        // write_log_log("write_log.log", "ERROR", "[RTU Server get data] Transaction_id %d failed to get data from device !!!", req.transaction_id);
+    }
+
+    buffer_release(buffer);
+    add_response(resp);
+}
+
+//====================================================================================================
+//========================= Modbus RTU frames (serial engine, no libmodbus read calls) ===============
+uint16_t rtu_crc16(const uint8_t *buf, int len)
+{
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < len; i++)
+    {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+//========================= Function: build request PDU (function code + data), return length or -1 ==
+// shared by RTU frames (address + PDU + CRC) and Modbus TCP frames (MBAP + PDU)
+int pdu_build_request(const RequestPacket *req, uint8_t *pdu)
+{
+    int len;
+    pdu[0] = req->function;
+    pdu[1] = req->address >> 8;
+    pdu[2] = req->address & 0xFF;
+    if (req->function == 3 || req->function == 4 || req->function == 23)
+    {
+        pdu[3] = req->quantity >> 8;
+        pdu[4] = req->quantity & 0xFF;
+        len = 5;
+    }
+    else if (req->function == 6)
+    {
+        pdu[3] = req->write_value[0] >> 8;
+        pdu[4] = req->write_value[0] & 0xFF;
+        return 5;
+    }
+    else if (req->function == 16)
+    {
+        pdu[3] = req->write_quantity >> 8;
+        pdu[4] = req->write_quantity & 0xFF;
+        len = 5;
+    }
+    else if (req->function == 22)
+    {
+        pdu[3] = req->and_mask >> 8;
+        pdu[4] = req->and_mask & 0xFF;
+        pdu[5] = req->or_mask >> 8;
+        pdu[6] = req->or_mask & 0xFF;
+        return 7;
+    }
+    else if (req->function == 17)
+    {
+        return 1; // report slave id, no data
+    }
+    else
+    {
+        return -1;
+    }
+    if (req->function == 23)
+    {
+        pdu[len++] = req->write_address >> 8;
+        pdu[len++] = req->write_address & 0xFF;
+        pdu[len++] = req->write_quantity >> 8;
+        pdu[len++] = req->write_quantity & 0xFF;
+    }
+    if (req->function == 16 || req->function == 23)
+    {
+        pdu[len++] = 2 * req->write_quantity; // byte count
+        for (int i = 0; i < req->write_quantity; i++)
+        {
+            pdu[len++] = req->write_value[i] >> 8;
+            pdu[len++] = req->write_value[i] & 0xFF;
+        }
+    }
+    return len;
+}
+
+//========================= Function: length of normal response PDU, -1 if function not supported ====
+int pdu_response_length(const RequestPacket *req)
+{
+    if (req->function == 3 || req->function == 4 || req->function == 23)
+    {
+        return 2 + 2 * req->quantity; // function, byte count, registers
+    }
+    if (req->function == 6 || req->function == 16)
+    {
+        return 5; // echo of address and value / quantity
+    }
+    if (req->function == 22)
+    {
+        return 7; // echo of address and masks
+    }
+    if (req->function == 17)
+    {
+        return 3; // function, byte count, data: length depends on the device, this is the minimum
+    }
+    return -1;
+}
+
+//========================= Function: check response PDU and copy registers ==========================
+// return number of registers in value: registers read, registers written (FC6 / FC16, the values
+// sent), 0 (FC22) or data bytes (FC17, one per value). -1 on wrong function, wrong echo or exception
+// response, errno is set
+int pdu_parse_response(const RequestPacket *req, const uint8_t *pdu, int len, uint16_t *value)
+{
+    if (len >= 2 && pdu[0] == (req->function | 0x80))
+    {
+        errno = MODBUS_ENOBASE + pdu[1]; // same errno as libmodbus for exception codes
+        return -1;
+    }
+    if (req->function == 17 && len >= 3 && pdu[0] == 17 && pdu[1] == len - 2)
+    {
+        int count = pdu[1] < MAX_READ_REGISTERS ? pdu[1] : MAX_READ_REGISTERS;
+        for (int i = 0; i < count; i++)
+        {
+            value[i] = pdu[2 + i];
+        }
+        return count;
+    }
+    if (pdu[0] != req->function || len != pdu_response_length(req))
+    {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    if (req->function == 3 || req->function == 4 || req->function == 23)
+    {
+        if (pdu[1] != 2 * req->quantity)
+        {
+            errno = EMBBADDATA;
+            return -1;
+        }
+        for (int i = 0; i < req->quantity; i++)
+        {
+            value[i] = (pdu[2 + 2 * i] << 8) | pdu[3 + 2 * i];
+        }
+        return req->quantity;
+    }
+    uint8_t echo[RTU_FRAME_SIZE];
+    pdu_build_request(req, echo); // FC6 / FC16 / FC22 answer with the start of the request
+    if (memcmp(pdu, echo, len) != 0)
+    {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    memcpy(value, req->write_value, req->write_quantity * sizeof(uint16_t));
+    return req->write_quantity;
+}
+
+//========================= Function: build request frame, return length or -1 if not supported =====
+int rtu_build_request(const RequestPacket *req, uint8_t *frame)
+{
+    frame[0] = req->rtu_id;
+    int len = pdu_build_request(req, frame + 1);
+    if (len < 0)
+    {
+        return -1;
+    }
+    len++;
+    uint16_t crc = rtu_crc16(frame, len);
+    frame[len++] = crc & 0xFF; // CRC low byte first
+    frame[len++] = crc >> 8;
+    return len;
+}
+
+//========================= Function: length of normal response frame ================================
+int rtu_response_length(const RequestPacket *req)
+{
+    return 3 + pdu_response_length(req); // rtu_id, PDU, CRC
+}
+
+//========================= Function: bytes still missing of response frame[0..len) ==================
+// until the function byte is read the response may be an exception (5 bytes), shorter than any other
+int rtu_frame_missing(const RequestPacket *req, const uint8_t *frame, int len)
+{
+    int expected = rtu_response_length(req);
+    if (len < 2 || (frame[1] & 0x80))
+    {
+        expected = 5; // exception response: rtu_id, function | 0x80, code, CRC
+    }
+    else if (req->function == 17)
+    {
+        expected = len < 3 ? 3 : 5 + frame[2]; // rtu_id, function, byte count, data, CRC
+    }
+    return expected > len ? expected - len : 0;
+}
+
+//========================= Function: 1 if frame[0..len) is a complete response ======================
+int rtu_frame_complete(const RequestPacket *req, const uint8_t *frame, int len)
+{
+    return rtu_frame_missing(req, frame, len) == 0;
+}
+
+//========================= Function: check response and copy registers ==============================
+// return number of registers, -1 on CRC error, wrong slave/function or exception response
+int rtu_parse_response(const RequestPacket *req, const uint8_t *frame, int len, uint16_t *value)
+{
+    if (len < 5 || rtu_crc16(frame, len - 2) != (frame[len - 2] | (frame[len - 1] << 8)))
+    {
+        errno = EMBBADCRC;
+        return -1;
+    }
+    if (frame[0] != req->rtu_id || (frame[1] & 0x7F) != req->function)
+    {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    return pdu_parse_response(req, frame + 1, len - 3, value);
+}
+
+//========================= Function: ask serial driver for low latency ===============================
+// USB adapters (FTDI) otherwise hold received bytes up to 16 ms before passing them on
+void serial_low_latency(int fd, const char *device)
+{
+#if SERIAL_LOW_LATENCY
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == -1)
+    {
+        printf("[RTU Server %s] Low latency mode not supported by driver.\n", device);
+        return;
+    }
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serial) == -1)
+    {
+        printf("[RTU Server %s] Failed to set low latency mode: %s\n", device, strerror(errno));
+    }
+#endif
+}
+
+//========================= Function: wake reader when bytes of whole frame are received ==============
+// VMIN bytes with VTIME 0: poll/epoll report the tty readable only when VMIN bytes are buffered.
+// Reads stay non-blocking (O_NONBLOCK), so a shorter frame can still be read at the timeout.
+int serial_set_vmin(int fd, int bytes)
+{
+    struct termios tios;
+    if (tcgetattr(fd, &tios) == -1)
+    {
+        return -1;
+    }
+    tios.c_cc[VMIN] = bytes > 255 ? 255 : bytes;
+    tios.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &tios);
+}
+
+//====================================================================================================
+//======================== Thread 1: receive packet from TCP Server ==================================
+void *receive_request_thread(void *arg)
+{
+    sqlite3 *db;
+    sqlite3_open("modbus_mapping.db", &db);
+    redisContext *redis = redisConnect("127.0.0.1", 6379);
+    redisReply *reply = redisCommand(redis, "SUBSCRIBE modbus_request modbus_discovery");
+
+    if (redis == NULL || redis->err)
+    {
+        fprintf(stderr, "[RTU Server connect Redis] Connection error: %s\n", redis->errstr);
+        return NULL;
+    }
+    else
+    {
+        printf("\n");
+        printf("[RTU Server connect Redis] Connected to Redis server\n");
+        // write_log_log("write_log.log", "INFO", "[RTU Server connect Redis] Connected to Redis server");
+        // write_log_db(db, "INFO", "Connected to Redis server");
+    }
+    freeReplyObject(reply);
+
+    printf("[RTU Server connect Redis] Subscribed to modbus_request and modbus_discovery\n");
+    // write_log_log("write_log.log", "INFO", "[RTU Server connect Redis] Subscribed to modbus_request");
+    // write_log_db(db, "INFO", "Subscribed to modbus_request");
+
+    while (1)
+    {
+        //-------------------------------------------------------------------------------------------------
+        //                     JSON data format:
+        //                        "message"                    -> element[0] - type of message,
+        //                    "modbus_response"                -> element[1] - channel name,
+        // "{\"transaction_id\":1,\"status\":0,\"value\":123}" -> element[2] - main
+        //-------------------------------------------------------------------------------------------------
+        redisReply *msg;
+        if (redisGetReply(redis, (void **)&msg) == REDIS_OK && msg)
+        {
+            if (msg->type == REDIS_REPLY_ARRAY && msg->elements == 3 && msg->element[2]->type == REDIS_REPLY_STRING)
+            {
+                const char *json_str = msg->element[2]->str;
+                json_error_t error;
+                json_t *root = json_loads(json_str, 0, &error);
+                if (!root)
+                {
+                    fprintf(stderr, "[RTU Server receive request] JSON parse error: %s\n", error.text);
+                    // write_log_log("write_log.log", "ERROR", "[RTU Server receive request] JSON parse error: %s !!!", error.text);
+                    // write_log_db(db, "ERROR", "JSON parse error: %s", error.text);
+                    freeReplyObject(msg);
+                    continue;
+                }
+                if (strcmp(msg->element[1]->str, "modbus_discovery") == 0)
+                {
+                    discovery_start(root);
+                    json_decref(root);
+                    freeReplyObject(msg);
+                    continue;
+                }
+                RequestPacket req = {0};
+                // json packet
+                req.transaction_id = json_integer_value(json_object_get(root, "transaction_id"));
+                req.rtu_id = json_integer_value(json_object_get(root, "rtu_id"));
+                req.address = json_integer_value(json_object_get(root, "rtu_address"));
+                req.function = json_integer_value(json_object_get(root, "function"));
+                req.quantity = json_integer_value(json_object_get(root, "quantity"));
+                json_t *timeout = json_object_get(root, "timeout_ms"); // time left until TCP server answers 0x0B
+                req.deadline_ms = now_ms() + (timeout ? json_integer_value(timeout) : CLIENT_TIMEOUT_MS);
+                int invalid = request_write_data(&req, json_object_get(root, "data"));
+                json_decref(root); // clean up JSON object
+
+                if (!invalid)
+                {
+                    invalid = validate_request(&req);
+                }
+                if (invalid)
+                {
+                    fail_request(&req, invalid);
+                    printf("[RTU Server receive request] Invalid request transaction_id %d: function %d address %d quantity %d, exception 0x%02X !!!\n",
+                           req.transaction_id, req.function, req.address, req.quantity, invalid);
+                    freeReplyObject(msg);
+                    continue;
+                }
+
+                TcpDevice *device = route_tcp_device(req.rtu_id);
+                if (device)
+                {
+                    if (add_request(&device->queue, req) != 0)
+                    {
+                        fail_request(&req, EXCEPTION_SERVER_BUSY);
+                        printf("[RTU Server receive request] Queue of %s full, transaction_id %d dropped !!!\n", device->ip, req.transaction_id);
+                    }
+                    freeReplyObject(msg);
+                    continue;
+                }
+
+                SerialPort *port = route_request(req.rtu_id);
+                if (add_request(&port->queue, req) != 0)
+                {
+                    fail_request(&req, EXCEPTION_SERVER_BUSY);
+                    printf("[RTU Server receive request] Queue of %s full, transaction_id %d dropped !!!\n", port->device, req.transaction_id);
+                    freeReplyObject(msg);
+                    continue;
+                }
+
+                printf("[RTU Server receive request] Received transaction_id %d, added to queue of %s\n", req.transaction_id, port->device);
+                // write_log_db(db, "INFO", "Received transaction_id %d, added to queue", req.transaction_id);
+                // write_log_log("write_log.log", "INFO", "[RTU Server receive request] Received transaction_id %d, added to queue", req.transaction_id);
+            }
+            freeReplyObject(msg);
+        }
+    }
+    redisFree(redis); // clean up Redis connection
+
+    return NULL;
+}
+
+//====================================================================================================
+//========================= Thread 2: send command for SmartLogger, one thread per serial port =======
+void *send_command_thread(void *arg)
+{
+    SerialPort *port = (SerialPort *)arg;
+    sqlite3 *db;
+    sqlite3_open("modbus_mapping.db", &db);
+    modbus_t *ctx = NULL;
+    int connected = 0;
+    int retry_ms = 0; // delay before next reopen, 0 after a request without port fault
+    long long bus_idle_ms = 0; // end of last request on the bus
+    long long next_reload = now_ms() + RATE_LIMIT_RELOAD_S * 1000;
+    long long next_plan_check = 0;
+    load_rate_limits(db);
+    load_retry_policies(db);
+
+    while (1)
+    {
+        if (now_ms() >= next_plan_check)
+        {
+            poll_plan_refresh(db, &port->plan, port, NULL);
+            next_plan_check = now_ms() + POLL_CONFIG_CHECK_MS;
+        }
+
+        if (!connected)
+        {
+            if (ctx != NULL)
+            {
+                modbus_close(ctx);
+                modbus_free(ctx);
+                ctx = NULL;
+            }
+            if (retry_ms > 0)
+            {
+                usleep(retry_ms * 1000);
+            }
+            retry_ms = port_retry_next(retry_ms);
+
+            ctx = modbus_new_rtu(port->device, port->baudrate, port->parity, port->data_bits, port->stop_bits);
+            if (!ctx)
+            {
+                fprintf(stderr, "[RTU Server %s] Failed to create Modbus RTU connection !!!\n", port->device);
+                // write_log_log("write_log.log", "ERROR", "[RTU Server] Failed to create Modbus RTU connection !!!");
+                continue;
+            }
+
+            if (modbus_connect(ctx) == -1)
+            {
+                fprintf(stderr, "[RTU Server %s] Modbus RTU connection failed: %s, retry in %d ms !!!\n", port->device, modbus_strerror(errno), retry_ms);
+                // write_log_log("write_log.log", "ERROR", "[RTU Server] Failed to create Modbus RTU connection !!!");
+                modbus_free(ctx);
+                ctx = NULL;
+                continue;
+            }
+
+            connected = 1;
+            serial_low_latency(modbus_get_socket(ctx), port->device);
+            printf("[RTU Server %s] Connected to Modbus RTU device.\n", port->device);
+            // write_log_log("write_log.log", "INFO", "[RTU Server] Connected to Modbus RTU device.");
+        }
+
+        if (now_ms() >= next_reload)
+        {
+            load_rate_limits(db);
+            load_retry_policies(db);
+            next_reload = now_ms() + RATE_LIMIT_RELOAD_S * 1000;
+        }
+
+        RequestPacket req;
+        long long wake_ms;
+        if (!pick_request(port, &req, &wake_ms))
+        {
+            wait_request(&port->queue, wake_ms); // new request, token, poll or deadline
+            continue;
+        }
+
+        modbus_set_slave(ctx, req.rtu_id); // deivce address
+
+        int rc = -1;
+        uint16_t scratch[MAX_READ_REGISTERS];
+        RegisterBuffer *buffer = buffer_take(&port->pool);
+        uint16_t *value = buffer ? buffer->value : scratch; // response queue backed up: value only
+        int timeout = request_timeout_ms(port, &req);
+        modbus_set_response_timeout(ctx, timeout / 1000, (timeout % 1000) * 1000);
+        modbus_set_byte_timeout(ctx, 0, byte_timeout_ms(port) * 1000);
+        long long gap_end_ms = bus_idle_ms + profile_frame_gap_ms(req.rtu_id);
+        if (now_ms() < gap_end_ms) // slave needs a longer silence on the bus (device profile)
+        {
+            usleep((gap_end_ms - now_ms()) * 1000);
+        }
+        long long start_ms = now_ms();
+        int read_errno = 0;
+        int on_bus = 1;
+
+        if (req.function == 3)
+        {
+            rc = modbus_read_registers(ctx, req.address, req.quantity, value);
+            read_errno = errno;
+            printf("[RTU Server] Number of registers read (Holding Regiser 0x03): %d\n", rc);
+        }
+        else if (req.function == 4)
+        {
+            rc = modbus_read_input_registers(ctx, req.address, req.quantity, value);
+            read_errno = errno;
+            printf("[RTU Server] Number of registers read (Input Regiser 0x04): %d\n", rc);
+        }
+        else if (req.function == 6 || req.function == 16)
+        {
+            rc = req.function == 6 ? modbus_write_register(ctx, req.address, req.write_value[0])
+                                   : modbus_write_registers(ctx, req.address, req.write_quantity, req.write_value);
+            read_errno = errno;
+            if (rc != -1)
+            {
+                memcpy(value, req.write_value, req.write_quantity * sizeof(uint16_t)); // response carries the written values
+            }
+            printf("[RTU Server] Number of registers written (0x%02X): %d\n", req.function, rc);
+        }
+        else if (req.function == 22)
+        {
+            rc = modbus_mask_write_register(ctx, req.address, req.and_mask, req.or_mask);
+            read_errno = errno;
+            rc = rc == -1 ? -1 : 0; // new value is not known
+            printf("[RTU Server] Mask write register (0x16): %s\n", rc != -1 ? "ok" : "failed");
+        }
+        else if (req.function == 23)
+        {
+            rc = modbus_write_and_read_registers(ctx, req.write_address, req.write_quantity, req.write_value,
+                                                 req.address, req.quantity, value);
+            read_errno = errno;
+            printf("[RTU Server] Number of registers read (Read/Write Multiple 0x17): %d\n", rc);
+        }
+        else if (req.function == 17)
+        {
+            uint8_t id[MAX_READ_REGISTERS];
+            rc = modbus_report_slave_id(ctx, sizeof(id), id);
+            read_errno = errno;
+            rc = rc > (int)sizeof(id) ? (int)sizeof(id) : rc; // rc is the full length, only sizeof(id) bytes are copied
+            for (int i = 0; i < rc; i++)
+            {
+                value[i] = id[i];
+            }
+            printf("[RTU Server] Report slave id of RTU_ID %d: %d bytes\n", req.rtu_id, rc);
+        }
+        else
+        {
+            printf("[RTU Server] Unsupported function: %d !!!\n", req.function);
+            // write_log_log("write_log.log", "ERROR", "[RTU Server] Unsupported function: %d !!!", req.function);
+            rc = -1;
+            read_errno = EMBXILFUN;
+            on_bus = 0;
+        }
+        long long elapsed_ms = now_ms() - start_ms;
+        if (on_bus)
+        {
+            profile_learn(&req, rc, read_errno, start_ms - bus_idle_ms);
+            bus_idle_ms = now_ms();
+        }
+
+        // discovery probes are not counted: a timeout is an unused id, not a slave failure, and an
+        // answer to a probe is no response time of polling and does not close a breaker
+        if (req.transaction_id != DISCOVERY_TRANSACTION_ID)
+        {
+            if (rc == -1 && read_errno == ETIMEDOUT)
+            {
+                latency_timeout(req.rtu_id);
+                breaker_failure(req.rtu_id);
+            }
+            else if (read_errno != EMBXILFUN && slave_answered(rc, read_errno))
+            {
+                // time to first byte = elapsed - time to receive the response
+                int response_bytes = rc != -1 ? rtu_response_length(&req) : 5;
+                latency_record(req.rtu_id, elapsed_ms - frame_time_ms(port, response_bytes));
+                breaker_success(req.rtu_id);
+            }
+        }
+
+        if (rc == -1 && port_fault(read_errno))
+        {
+            printf("[RTU Server %s] Port fault: %s, reopen !!!\n", port->device, modbus_strerror(read_errno));
+            connected = 0;
+        }
+        else
+        {
+            retry_ms = 0;
+            if (rc == -1 && read_errno != EMBXILFUN)
+            {
+                modbus_flush(ctx); // drop rest of a late or broken response
+            }
+        }
+        if (retry_request(port, &req, rc, read_errno))
+        {
+            buffer_release(buffer);
+            continue;
+        }
+        finish_request(&req, rc, buffer, value, read_errno);
+    }
+
+    if (ctx)
+    {
+        modbus_close(ctx);
+        modbus_free(ctx);
+    }
+
+    return NULL;
+}
+
+//====================================================================================================
+//========================= Event-driven serial engine: all ports in one epoll thread ================
+// each port runs its own state machine: idle -> send -> wait -> receive -> idle
+// a response ends when it has the length expected from its header (exception, byte count, request).
+// Bytes reach userspace in chunks (UART FIFO trigger, USB latency timer), so the time between reads
+// says nothing about gaps on the wire: a frame that stops short ends RTU_CHUNK_GAP_US after the time
+// its missing bytes need and fails CRC. Next request not before t3.5 after the last byte.
+typedef enum
+{
+    LINK_CLOSED,   // port not open, reopen at deadline_us
+    LINK_IDLE,     // nothing on the wire
+    LINK_GAP,      // req waits until deadline_us, the slave needs a longer bus silence (device profile)
+    LINK_SENDING,  // request frame partly written
+    LINK_WAITING,  // waiting for first byte of response
+    LINK_RECEIVING // response partly received
+} LinkState;
+
+typedef struct
+{
+    int index; // epoll data, index in links[]
+    SerialPort *port;
+    modbus_t *ctx; // only used to open and configure the tty
+    int fd;
+    LinkState state;
+    RequestPacket req;
+    uint8_t tx[RTU_FRAME_SIZE];
+    int tx_len;
+    int tx_sent;
+    uint8_t rx[RTU_FRAME_SIZE];
+    int rx_len;
+    int vmin;              // VMIN of tty, bytes buffered before epoll wakes us
+    long long sent_us;     // request written, for response time
+    long long last_rx_us;  // last byte of response
+    long long ready_us;    // next request not before (t3.5 after last frame)
+    long long idle_us;     // bus silent since (last byte of response or timeout)
+    double idle_ms;        // bus silence before the request on the wire
+    long long deadline_us; // write/response timeout, end of frame or time to reopen port
+    int retry_ms;          // delay of next reopen, see port_retry_next()
+} SerialLink;
+
+//========================= Function: t3.5 of serial port in us ======================================
+// 11 bit characters as in the spec, fixed 1750 us above 19200 baud
+int rtu_t35_us(const SerialPort *port)
+{
+    return port->baudrate > 19200 ? 1750 : 3500000 * 11 / port->baudrate;
+}
+
+//========================= Function: set epoll events of serial port ================================
+void link_watch(SerialLink *link, int epfd, int op, int want_out)
+{
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.u32 = link->index;
+    epoll_ctl(epfd, op, link->fd, &ev);
+}
+
+//========================= Function: open serial port of link ======================================
+void link_open(SerialLink *link, int epfd)
+{
+    SerialPort *port = link->port;
+    link->ctx = modbus_new_rtu(port->device, port->baudrate, port->parity, port->data_bits, port->stop_bits);
+    if (!link->ctx || modbus_connect(link->ctx) == -1)
+    {
+        fprintf(stderr, "[RTU Server %s] Modbus RTU connection failed: %s, retry in %d ms !!!\n", port->device, modbus_strerror(errno), link->retry_ms);
+        if (link->ctx)
+        {
+            modbus_free(link->ctx);
+            link->ctx = NULL;
+        }
+        link->state = LINK_CLOSED;
+        link->deadline_us = now_us() + link->retry_ms * 1000LL;
+        link->retry_ms = port_retry_next(link->retry_ms);
+        return;
+    }
+    link->fd = modbus_get_socket(link->ctx);
+    fcntl(link->fd, F_SETFL, fcntl(link->fd, F_GETFL) | O_NONBLOCK);
+    serial_low_latency(link->fd, port->device);
+    link->vmin = 0; // set by first request
+    link_watch(link, epfd, EPOLL_CTL_ADD, 0);
+    link->state = LINK_IDLE;
+    link->ready_us = 0;
+    printf("[RTU Server %s] Connected to Modbus RTU device (serial engine, t3.5 %d us).\n",
+           port->device, rtu_t35_us(port));
+}
+
+//========================= Function: close faulty serial port, reopen by retry schedule ==============
+void link_close(SerialLink *link, int epfd)
+{
+    printf("[RTU Server %s] Port fault, reopen in %d ms !!!\n", link->port->device, link->retry_ms);
+    if (link->state == LINK_GAP)
+    {
+        finish_request(&link->req, -1, NULL, NULL, EIO); // was not sent
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, link->fd, NULL);
+    modbus_close(link->ctx);
+    modbus_free(link->ctx);
+    link->ctx = NULL;
+    link->fd = -1;
+    link->state = LINK_CLOSED;
+    link->deadline_us = now_us() + link->retry_ms * 1000LL;
+    link->retry_ms = port_retry_next(link->retry_ms);
+}
+
+//========================= Function: end current request of link ====================================
+// rc: number of registers, -1 if failed with errno err. Only port faults close the port.
+void link_finish(SerialLink *link, int epfd, int rc, RegisterBuffer *buffer, const uint16_t *value, int err)
+{
+    profile_learn(&link->req, rc, err, link->idle_ms);
+    if (retry_request(link->port, &link->req, rc, err))
+    {
+        buffer_release(buffer);
+    }
+    else
+    {
+        finish_request(&link->req, rc, buffer, value, err);
+    }
+    if (rc == -1 && port_fault(err))
+    {
+        link_close(link, epfd);
+        return;
+    }
+    link->retry_ms = 0;
+    link->state = LINK_IDLE;
+    // bus silent for t3.5 after last byte; after a timeout that time has passed already
+    link->ready_us = link->rx_len > 0 ? link->last_rx_us + rtu_t35_us(link->port) : 0;
+    link->idle_us = link->rx_len > 0 ? link->last_rx_us : now_us();
+}
+
+//========================= Function: response frame ended, check it =================================
+void link_frame_end(SerialLink *link, int epfd)
+{
+    uint16_t scratch[MAX_READ_REGISTERS];
+    RegisterBuffer *buffer = buffer_take(&link->port->pool);
+    uint16_t *value = buffer ? buffer->value : scratch;
+    int rc = rtu_parse_response(&link->req, link->rx, link->rx_len, value);
+    int err = errno;
+    printf("[RTU Server %s] Number of registers read (0x%02X): %d\n", link->port->device, link->req.function, rc);
+    link_finish(link, epfd, rc, buffer, value, err);
+}
+
+//========================= Function: write request frame without blocking ===========================
+void link_write(SerialLink *link, int epfd)
+{
+    while (link->tx_sent < link->tx_len)
+    {
+        ssize_t n = write(link->fd, link->tx + link->tx_sent, link->tx_len - link->tx_sent);
+        if (n > 0)
+        {
+            link->tx_sent += n;
+        }
+        else if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            if (link->state != LINK_SENDING)
+            {
+                link_watch(link, epfd, EPOLL_CTL_MOD, 1); // tty buffer full, wait for EPOLLOUT
+            }
+            link->state = LINK_SENDING;
+            return;
+        }
+        else
+        {
+            link_finish(link, epfd, -1, NULL, NULL, errno);
+            return;
+        }
+    }
+    if (link->state == LINK_SENDING)
+    {
+        link_watch(link, epfd, EPOLL_CTL_MOD, 0);
+    }
+    link->state = LINK_WAITING;
+    link->rx_len = 0;
+    link->sent_us = now_us();
+    // first byte within the response timeout, epoll wakes when the first VMIN bytes are here
+    link->deadline_us = link->sent_us + request_timeout_ms(link->port, &link->req) * 1000LL +
+                        (long long)(frame_time_ms(link->port, rtu_frame_missing(&link->req, link->rx, 0)) * 1000);
+}
+
+//========================= Function: wake engine when the next bytes of the frame are buffered =======
+// SERIAL_LOW_LATENCY: VMIN = bytes still missing, so a response takes two wakeups at most (first 5
+// bytes, which may be a whole exception, then the rest). Reads stay non-blocking.
+void link_set_vmin(SerialLink *link, int bytes)
+{
+#if SERIAL_LOW_LATENCY
+    if (bytes != link->vmin && serial_set_vmin(link->fd, bytes) == 0)
+    {
+        link->vmin = bytes;
+    }
+#endif
+}
+
+//========================= Function: start request on idle link =====================================
+void link_start(SerialLink *link, int epfd, const RequestPacket *req)
+{
+    link->req = *req;
+    link->tx_len = rtu_build_request(req, link->tx);
+    if (link->tx_len < 0 || req->quantity < 1 || rtu_response_length(req) > RTU_FRAME_SIZE)
+    {
+        printf("[RTU Server] Unsupported function: %d !!!\n", req->function);
+        finish_request(req, -1, NULL, NULL, EMBXILFUN);
+        return;
+    }
+    tcflush(link->fd, TCIFLUSH); // drop bytes left from an old response
+    link->idle_ms = (now_us() - link->idle_us) / 1000.0;
+    link_set_vmin(link, rtu_frame_missing(req, link->rx, 0)); // exception length, it may be one
+    link->tx_sent = 0;
+    link->rx_len = 0;
+    link->deadline_us = now_us() + RESPONSE_TIMEOUT_MS * 1000LL; // write must not block longer
+    link_write(link, epfd);
+}
+
+//========================= Function: read available bytes, finish request when frame is complete ====
+void link_read(SerialLink *link, int epfd)
+{
+    uint8_t buf[RTU_FRAME_SIZE];
+    while (1)
+    {
+        ssize_t n = read(link->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n < 0 && errno != EAGAIN)
+            {
+                if (link->state == LINK_WAITING || link->state == LINK_RECEIVING)
+                {
+                    link_finish(link, epfd, -1, NULL, NULL, errno);
+                }
+                else
+                {
+                    link_close(link, epfd);
+                }
+            }
+            return;
+        }
+        if (link->state != LINK_WAITING && link->state != LINK_RECEIVING)
+        {
+            continue; // no request on the wire, stray bytes
+        }
+
+        long long now = now_us();
+        if (link->state == LINK_WAITING && link->req.transaction_id != DISCOVERY_TRANSACTION_ID) // probes not counted
+        {
+            if (now < link->deadline_us) // short frame read at timeout: arrival time unknown
+            {
+                // first byte came in the time of this chunk before the wakeup
+                latency_record(link->req.rtu_id, (now - link->sent_us) / 1000.0 - frame_time_ms(link->port, n));
+            }
+            breaker_success(link->req.rtu_id);
+        }
+        int copy = n < RTU_FRAME_SIZE - link->rx_len ? n : RTU_FRAME_SIZE - link->rx_len;
+        memcpy(link->rx + link->rx_len, buf, copy);
+        link->rx_len += copy;
+        link->state = LINK_RECEIVING;
+        link->last_rx_us = now;
+        int missing = rtu_frame_missing(&link->req, link->rx, link->rx_len);
+        if (missing == 0)
+        {
+            link_frame_end(link, epfd); // expected length reached
+            return;
+        }
+        link_set_vmin(link, missing);
+        // frame stopped short (broken or foreign) if the rest is not here by then
+        link->deadline_us = now + (long long)(frame_time_ms(link->port, missing) * 1000) + RTU_CHUNK_GAP_US;
+    }
+}
+
+//========================= Thread 2 (SERIAL_ENGINE_EPOLL): drive all serial ports ===================
+void *serial_engine_thread(void *arg)
+{
+    sqlite3 *db;
+    sqlite3_open("modbus_mapping.db", &db);
+    long long next_reload = now_ms() + RATE_LIMIT_RELOAD_S * 1000;
+    long long next_plan_check = 0;
+    load_rate_limits(db);
+    load_retry_policies(db);
+
+    int epfd = epoll_create1(0);
+    int wake_fd = eventfd(0, EFD_NONBLOCK); // written by add_request
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK); // us timeouts, epoll_wait has only ms
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = MAX_PORTS;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+    ev.data.u32 = MAX_PORTS + 1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+    SerialLink links[MAX_PORTS];
+    for (int i = 0; i < port_count; i++)
+    {
+        memset(&links[i], 0, sizeof(SerialLink));
+        links[i].index = i;
+        links[i].port = &serial_ports[i];
+        links[i].fd = -1;
+        serial_ports[i].queue.wake_fd = wake_fd;
+        link_open(&links[i], epfd);
+    }
+
+    struct epoll_event events[MAX_PORTS + 2];
+    while (1)
+    {
+        if (now_ms() >= next_reload)
+        {
+            load_rate_limits(db);
+            load_retry_policies(db);
+            next_reload = now_ms() + RATE_LIMIT_RELOAD_S * 1000;
+        }
+        if (now_ms() >= next_plan_check)
+        {
+            for (int i = 0; i < port_count; i++)
+            {
+                poll_plan_refresh(db, &serial_ports[i].plan, &serial_ports[i], NULL);
+            }
+            next_plan_check = now_ms() + POLL_CONFIG_CHECK_MS;
+        }
+
+        //------------------------------------------------------------------------------------
+        // start requests on idle ports, find next timeout
+        long long wake = now_us() + 1000000;
+        for (int i = 0; i < port_count; i++)
+        {
+            SerialLink *link = &links[i];
+            if (link->state == LINK_CLOSED && now_us() >= link->deadline_us)
+            {
+                link_open(link, epfd);
+            }
+            RequestPacket req;
+            long long pick_wake_ms;
+            while (link->state == LINK_IDLE)
+            {
+                if (now_us() < link->ready_us) // t3.5 after last frame not over yet
+                {
+                    wake = link->ready_us < wake ? link->ready_us : wake;
+                    break;
+                }
+                if (!pick_request(link->port, &req, &pick_wake_ms))
+                {
+                    wake = pick_wake_ms * 1000 < wake ? pick_wake_ms * 1000 : wake;
+                    break;
+                }
+                long long gap_end_us = link->idle_us + profile_frame_gap_ms(req.rtu_id) * 1000LL;
+                if (now_us() < gap_end_us) // slave needs a longer silence, hold its request
+                {
+                    link->req = req;
+                    link->state = LINK_GAP;
+                    link->deadline_us = gap_end_us;
+                    break;
+                }
+                link_start(link, epfd, &req);
+            }
+            if (link->state != LINK_IDLE && link->deadline_us < wake)
+            {
+                wake = link->deadline_us;
+            }
+        }
+
+        struct itimerspec timer = {0};
+        timer.it_value.tv_sec = wake / 1000000;
+        timer.it_value.tv_nsec = (wake % 1000000) * 1000;
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+        int n = epoll_wait(epfd, events, MAX_PORTS + 2, -1);
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.u32 >= MAX_PORTS)
+            {
+                uint64_t count;
+                int fd = events[i].data.u32 == MAX_PORTS ? wake_fd : timer_fd;
+                while (read(fd, &count, sizeof(count)) > 0)
+                {
+                }
+                continue;
+            }
+            SerialLink *link = &links[events[i].data.u32];
+            if (link->state == LINK_SENDING && (events[i].events & EPOLLOUT))
+            {
+                link_write(link, epfd);
+            }
+            if (link->state != LINK_CLOSED && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            {
+                link_read(link, epfd);
+            }
+        }
+
+        //------------------------------------------------------------------------------------
+        // write and response timeouts, end of frame by idle line
+        for (int i = 0; i < port_count; i++)
+        {
+            SerialLink *link = &links[i];
+            if (link->state == LINK_RECEIVING && now_us() >= link->deadline_us)
+            {
+                link_read(link, epfd); // fewer bytes than VMIN are not reported by epoll
+                if (link->state != LINK_RECEIVING)
+                {
+                    continue;
+                }
+            }
+            if (link->state == LINK_GAP && now_us() >= link->deadline_us)
+            {
+                RequestPacket req = link->req;
+                link->state = LINK_IDLE;
+                link_start(link, epfd, &req);
+            }
+            else if (link->state == LINK_RECEIVING && now_us() >= link->deadline_us)
+            {
+                link_frame_end(link, epfd); // rest of frame did not come: broken frame
+            }
+            else if ((link->state == LINK_SENDING || link->state == LINK_WAITING) && now_us() >= link->deadline_us)
+            {
+                printf("[RTU Server %s] Response timeout for transaction_id %d !!!\n", link->port->device, link->req.transaction_id);
+                if (link->state == LINK_WAITING && link->req.transaction_id != DISCOVERY_TRANSACTION_ID)
+                {
+                    latency_timeout(link->req.rtu_id);
+                    breaker_failure(link->req.rtu_id);
+                }
+                link_finish(link, epfd, -1, NULL, NULL, ETIMEDOUT);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+//====================================================================================================
+//========================= Thread 2 (TCP devices): all Modbus TCP devices from one epoll thread =====
+//  connect, send, receive and timeouts of every connection are non-blocking state machines.
+//  epoll data: device index * TCP_CONNECTIONS_MAX + connection index, TCP_WAKE_EVENT for the queues
+#define TCP_WAKE_EVENT 0xFFFFFFFFu
+
+void tcp_watch(TcpConn *conn, int epfd, int op, int want_out)
+{
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+    ev.data.u32 = (conn->device - tcp_devices) * TCP_CONNECTIONS_MAX + (conn - conn->device->conns);
+    epoll_ctl(epfd, op, conn->fd, &ev);
+}
+
+//========================= Function: end request on connection =====================================
+void tcp_finish(TcpConn *conn, TcpInflight *inflight, int rc, RegisterBuffer *buffer, const uint16_t *value, int err)
+{
+    profile_learn(&inflight->req, rc, err, -1);
+    if (inflight->expired) // already failed, late answer only teaches the profile
+    {
+        buffer_release(buffer);
+    }
+    else
+    {
+        if (rc == -1)
+        {
+            conn->device->failed_requests++;
+        }
+        finish_request(&inflight->req, rc, buffer, value, err);
+    }
+    *inflight = conn->inflight[--conn->inflight_count]; // order of inflight does not matter
+}
+
+//========================= Function: fail request past its deadline, keep it on the wire ============
+// a client request fails with 0x0B, a poll counts as missed. The connection stays open: the late
+// answer is matched by tid and dropped in tcp_finish().
+void tcp_expire(TcpConn *conn, TcpInflight *inflight)
+{
+    inflight->expired = 1;
+    if (inflight->req.transaction_id == POLL_TRANSACTION_ID)
+    {
+        conn->device->missed_polls++;
+        return;
+    }
+    conn->device->failed_requests++;
+    finish_request(&inflight->req, -1, NULL, NULL, ETIMEDOUT);
+}
+
+//========================= Function: close connection, fail its requests, reconnect later ===========
+void tcp_close(TcpConn *conn, int epfd, int err)
+{
+    TcpDevice *device = conn->device;
+    if (conn->state == TCP_CONNECTING)
+    {
+        device->down = 1; // device not reachable, fail requests at once
+    }
+    if (conn->state != TCP_CLOSED)
+    {
+        printf("[RTU Server TCP %s:%d] Connection closed: %s, reconnect in %d ms !!!\n", device->ip, device->port, strerror(err), conn->retry_ms);
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    while (conn->inflight_count > 0)
+    {
+        tcp_finish(conn, &conn->inflight[0], -1, NULL, NULL, err);
+    }
+    conn->fd = -1;
+    conn->state = TCP_CLOSED;
+    conn->tx_len = 0;
+    conn->rx_len = 0;
+    conn->deadline_ms = now_ms() + conn->retry_ms;
+    conn->retry_ms = port_retry_next(conn->retry_ms);
+}
+
+//========================= Function: start non-blocking connect =====================================
+void tcp_connect(TcpConn *conn, int epfd)
+{
+    TcpDevice *device = conn->device;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(device->port);
+    if (inet_pton(AF_INET, device->ip, &addr.sin_addr) != 1)
+    {
+        printf("[RTU Server TCP] Invalid ip_address %s of device %d !!!\n", device->ip, device->device_id);
+        conn->deadline_ms = now_ms() + PORT_RETRY_MAX_MS;
+        return;
+    }
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(conn->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    device->reconnects++;
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS)
+    {
+        printf("[RTU Server TCP %s:%d] Connect failed: %s, retry in %d ms !!!\n", device->ip, device->port, strerror(errno), conn->retry_ms);
+        close(conn->fd);
+        conn->fd = -1;
+        device->down = 1;
+        conn->deadline_ms = now_ms() + conn->retry_ms;
+        conn->retry_ms = port_retry_next(conn->retry_ms);
+        return;
+    }
+    conn->state = TCP_CONNECTING;
+    conn->deadline_ms = now_ms() + TCP_CONNECT_TIMEOUT_MS;
+    tcp_watch(conn, epfd, EPOLL_CTL_ADD, 1); // writable when connected
+}
+
+//========================= Function: write queued request frames ====================================
+void tcp_flush(TcpConn *conn, int epfd)
+{
+    int sent = 0;
+    while (sent < conn->tx_len)
+    {
+        ssize_t n = send(conn->fd, conn->tx + sent, conn->tx_len - sent, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            sent += n;
+        }
+        else if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        else
+        {
+            tcp_close(conn, epfd, errno);
+            return;
+        }
+    }
+    memmove(conn->tx, conn->tx + sent, conn->tx_len - sent);
+    conn->tx_len -= sent;
+    tcp_watch(conn, epfd, EPOLL_CTL_MOD, conn->tx_len > 0);
+}
+
+//========================= Function: parse complete response frames in rx ===========================
+void tcp_parse(TcpConn *conn, int epfd)
+{
+    int pos = 0;
+    while (conn->rx_len - pos >= 7)
+    {
+        const uint8_t *frame = conn->rx + pos;
+        int length = (frame[4] << 8) | frame[5]; // unit id + PDU
+        if (length < 3 || length > TCP_FRAME_SIZE - 6)
+        {
+            tcp_close(conn, epfd, EMBBADDATA); // lost frame boundary
+            return;
+        }
+        if (conn->rx_len - pos < 6 + length)
+        {
+            break;
+        }
+        pos += 6 + length;
+
+        int tid = (frame[0] << 8) | frame[1];
+        TcpInflight *inflight = NULL;
+        for (int i = 0; i < conn->inflight_count; i++)
+        {
+            if (conn->inflight[i].tid == tid)
+            {
+                inflight = &conn->inflight[i];
+            }
+        }
+        if (!inflight)
+        {
+            continue; // not ours
+        }
+
+        uint16_t scratch[MAX_READ_REGISTERS];
+        RegisterBuffer *buffer = buffer_take(&conn->device->pool);
+        uint16_t *value = buffer ? buffer->value : scratch;
+        int rc = pdu_parse_response(&inflight->req, frame + 7, length - 1, value);
+        tcp_finish(conn, inflight, rc, buffer, value, rc == -1 ? errno : 0);
+    }
+    memmove(conn->rx, conn->rx + pos, conn->rx_len - pos);
+    conn->rx_len -= pos;
+}
+
+//========================= Function: read from connection ===========================================
+void tcp_read(TcpConn *conn, int epfd)
+{
+    while (conn->state == TCP_OPEN)
+    {
+        ssize_t n = recv(conn->fd, conn->rx + conn->rx_len, sizeof(conn->rx) - conn->rx_len, 0);
+        if (n > 0)
+        {
+            conn->rx_len += n;
+            tcp_parse(conn, epfd);
+        }
+        else if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        else
+        {
+            tcp_close(conn, epfd, n == 0 ? ECONNRESET : errno);
+            return;
+        }
+    }
+}
+
+//========================= Function: queue request frame on connection ==============================
+void tcp_send(TcpConn *conn, const RequestPacket *req)
+{
+    TcpInflight *inflight = &conn->inflight[conn->inflight_count++];
+    inflight->req = *req;
+    inflight->tid = conn->next_tid++;
+    inflight->deadline_ms = now_ms() + TCP_RESPONSE_TIMEOUT_MS;
+    inflight->expired = 0;
+
+    uint8_t *frame = conn->tx + conn->tx_len;
+    int length = 1 + pdu_build_request(req, frame + 7); // unit id + PDU
+    frame[0] = inflight->tid >> 8;
+    frame[1] = inflight->tid & 0xFF;
+    frame[2] = 0; // protocol id
+    frame[3] = 0;
+    frame[4] = length >> 8;
+    frame[5] = length & 0xFF;
+    frame[6] = slave_unit[req->rtu_id];
+    conn->tx_len += 6 + length;
+}
+
+//========================= Function: due poll block of TCP device with earliest deadline =============
+// like poll_due() of serial ports, without breaker and rate limit. Sets device->next_poll_ms.
+PollBlock *tcp_poll_due(TcpDevice *device, long long now)
+{
+    PollBlock *due = NULL;
+    device->next_poll_ms = now + POLL_CONFIG_CHECK_MS;
+    for (int b = 0; b < device->plan.block_count; b++)
+    {
+        PollBlock *block = &device->plan.blocks[b];
+        while (block->next_ms + block->scan_ms <= now) // expired, never reached the wire
+        {
+            block->next_ms += block->scan_ms;
+            device->missed_polls++;
+        }
+        if (block->next_ms > now)
+        {
+            device->next_poll_ms = block->next_ms < device->next_poll_ms ? block->next_ms : device->next_poll_ms;
+        }
+        else if (!due || block->next_ms + block->scan_ms < due->next_ms + due->scan_ms)
+        {
+            due = block;
+        }
+    }
+    if (due)
+    {
+        device->next_poll_ms = now; // may be more
+    }
+    return due;
+}
+
+//========================= Function: hand queued requests and due polls to open connections ==========
+// least loaded connection first, client requests before polls. A device with no open connection
+// after a failed connect fails its requests at once (0x0B) and skips its polls.
+void tcp_dispatch(TcpDevice *device, int epfd, long long now)
+{
+    int open = 0;
+    for (int c = 0; c < device->connections; c++)
+    {
+        open += device->conns[c].state == TCP_OPEN;
+    }
+    if (!open && !device->down)
+    {
+        return; // (re)connect in progress, requests wait
+    }
+
+    RequestPacket req;
+    while (1)
+    {
+        TcpConn *conn = NULL;
+        for (int c = 0; c < device->connections; c++)
+        {
+            TcpConn *candidate = &device->conns[c];
+            if (candidate->state == TCP_OPEN && candidate->inflight_count < device->pipeline &&
+                (!conn || candidate->inflight_count < conn->inflight_count))
+            {
+                conn = candidate;
+            }
+        }
+        if (open && !conn)
+        {
+            break; // all connections busy
+        }
+        if (!try_take_request(&device->queue, &req))
+        {
+            PollBlock *block = now >= device->next_poll_ms ? tcp_poll_due(device, now) : NULL;
+            if (!block)
+            {
+                break;
+            }
+            if (!conn)
+            {
+                block->next_ms += block->scan_ms; // device down, skip this cycle
+                continue;
+            }
+            poll_fill_request(&device->plan, block, &req);
+            device->sent_polls++;
+            tcp_send(conn, &req);
+            continue;
+        }
+        if (!conn || now >= req.deadline_ms)
+        {
+            device->failed_requests++;
+            fail_request(&req, EXCEPTION_TARGET_NO_RESPONSE);
+            continue;
+        }
+        if (pdu_response_length(&req) < 0 || !profile_supports(req.rtu_id, req.function))
+        {
+            fail_request(&req, EXCEPTION_ILLEGAL_FUNCTION);
+            continue;
+        }
+        device->sent_requests++;
+        tcp_send(conn, &req);
+    }
+    for (int c = 0; c < device->connections; c++)
+    {
+        if (device->conns[c].state == TCP_OPEN && device->conns[c].tx_len > 0)
+        {
+            tcp_flush(&device->conns[c], epfd);
+        }
+    }
+}
+
+//========================= Function: reload poll plans of all TCP devices when database changed =====
+// one PRAGMA data_version and one scan of get_data for all devices
+void tcp_poll_plans_refresh(sqlite3 *db, int *data_version)
+{
+    int version = database_version(db);
+    if (version != *data_version)
+    {
+        *data_version = version;
+        PollTag *tags = NULL;
+        int count = read_poll_tags(db, NULL, NULL, &tags);
+        for (int i = 0; i < tcp_device_count && count >= 0; i++)
+        {
+            poll_plan_set_tags(&tcp_devices[i].plan, tags, count, NULL, &tcp_devices[i]);
+        }
+        free(tags);
+    }
+    for (int i = 0; i < tcp_device_count; i++)
+    {
+        poll_plan_recheck(&tcp_devices[i].plan, NULL, &tcp_devices[i]);
+        tcp_devices[i].next_poll_ms = 0;
+    }
+}
+
+void *tcp_engine_thread(void *arg)
+{
+    sqlite3 *db;
+    sqlite3_open("modbus_mapping.db", &db);
+    long long next_plan_check = 0;
+    int data_version = -2; // load poll plans on first check
+
+    struct rlimit files; // hundreds of devices with a few connections each
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max &&
+        files.rlim_cur < (rlim_t)tcp_device_count * TCP_CONNECTIONS_MAX + 64)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    int epfd = epoll_create1(0);
+    int wake_fd = eventfd(0, EFD_NONBLOCK); // written by add_request
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = TCP_WAKE_EVENT;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+    for (int i = 0; i < tcp_device_count; i++)
+    {
+        tcp_devices[i].queue.wake_fd = wake_fd;
+    }
+
+    struct epoll_event events[256];
+    while (1)
+    {
+        if (now_ms() >= next_plan_check)
+        {
+            tcp_poll_plans_refresh(db, &data_version);
+            next_plan_check = now_ms() + POLL_CONFIG_CHECK_MS;
+        }
+
+        //------------------------------------------------------------------------------------
+        // timeouts, reconnects, new requests and polls; find next deadline
+        long long now = now_ms();
+        long long wake = now + 1000;
+        for (int i = 0; i < tcp_device_count; i++)
+        {
+            TcpDevice *device = &tcp_devices[i];
+            for (int c = 0; c < device->connections; c++)
+            {
+                TcpConn *conn = &device->conns[c];
+                if (conn->state == TCP_CLOSED && now >= conn->deadline_ms)
+                {
+                    tcp_connect(conn, epfd);
+                }
+                else if (conn->state == TCP_CONNECTING && now >= conn->deadline_ms)
+                {
+                    tcp_close(conn, epfd, ETIMEDOUT);
+                }
+                for (int r = 0; r < conn->inflight_count; r++)
+                {
+                    if (!conn->inflight[r].expired && now >= conn->inflight[r].req.deadline_ms)
+                    {
+                        tcp_expire(conn, &conn->inflight[r]);
+                    }
+                    if (now >= conn->inflight[r].deadline_ms)
+                    {
+                        // stream may still carry the late answer: start over on a new connection
+                        printf("[RTU Server TCP %s:%d] Response timeout for transaction_id %d !!!\n", device->ip, device->port, conn->inflight[r].req.transaction_id);
+                        conn->retry_ms = 0;
+                        tcp_close(conn, epfd, ETIMEDOUT);
+                        break;
+                    }
+                }
+            }
+            tcp_dispatch(device, epfd, now);
+            if (device->next_poll_ms > now && device->next_poll_ms < wake) // due polls wait for a response or connect event
+            {
+                wake = device->next_poll_ms;
+            }
+            for (int c = 0; c < device->connections; c++)
+            {
+                TcpConn *conn = &device->conns[c];
+                if (conn->state != TCP_OPEN && conn->deadline_ms < wake)
+                {
+                    wake = conn->deadline_ms;
+                }
+                for (int r = 0; r < conn->inflight_count; r++)
+                {
+                    TcpInflight *inflight = &conn->inflight[r];
+                    wake = inflight->deadline_ms < wake ? inflight->deadline_ms : wake;
+                    if (!inflight->expired && inflight->req.deadline_ms < wake)
+                    {
+                        wake = inflight->req.deadline_ms;
+                    }
+                }
+            }
+        }
+
+        int timeout = wake > now ? (int)(wake - now) : 0;
+        int n = epoll_wait(epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.u32 == TCP_WAKE_EVENT)
+            {
+                uint64_t count;
+                while (read(wake_fd, &count, sizeof(count)) > 0)
+                {
+                }
+                continue;
+            }
+            TcpDevice *device = &tcp_devices[events[i].data.u32 / TCP_CONNECTIONS_MAX];
+            TcpConn *conn = &device->conns[events[i].data.u32 % TCP_CONNECTIONS_MAX];
+            if (conn->state == TCP_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err)
+                {
+                    tcp_close(conn, epfd, err);
+                    continue;
+                }
+                conn->state = TCP_OPEN;
+                conn->retry_ms = 0;
+                device->down = 0;
+                tcp_watch(conn, epfd, EPOLL_CTL_MOD, 0);
+                printf("[RTU Server TCP %s:%d] Connected.\n", device->ip, device->port);
+                continue;
+            }
+            if (conn->state == TCP_OPEN && (events[i].events & EPOLLOUT))
+            {
+                tcp_flush(conn, epfd);
+            }
+            if (conn->state == TCP_OPEN && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+            {
+                tcp_read(conn, epfd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+//====================================================================================================
+//======================== Thread 3: send response for tcp server (modbus_response) =====================
+void *send_response_thread(void *arg)
+{
+    sqlite3 *db;
+    sqlite3_open("modbus_mapping.db", &db);
+    redisContext *redis = redisConnect("127.0.0.1", 6379);
+
     while (1)
     {
         ResponsePacket resp = take_response();
@@ -306,8 +4634,18 @@ void *send_response_thread(void *arg)
         json_object_set_new(root, "rtu_id", json_integer(resp.rtu_id));
         json_object_set_new(root, "rtu_address", json_integer(resp.address));
         json_object_set_new(root, "function", json_integer(resp.function));
-        // json_object_set_new(root, "status", json_integer(resp.status));
+        json_object_set_new(root, "status", json_integer(resp.status));
         json_object_set_new(root, "value", json_integer(resp.value));
+        if (resp.buffer)
+        {
+            json_t *values = json_array(); // all registers read
+            for (int i = 0; i < resp.quantity; i++)
+            {
+                json_array_append_new(values, json_integer(resp.buffer->value[i]));
+            }
+            json_object_set_new(root, "values", values);
+            buffer_release(resp.buffer);
+        }
         char *json_str = json_dumps(root, 0);
 
         redisCommand(redis, "PUBLISH modbus_response %s", json_str);
@@ -321,32 +4659,584 @@ void *send_response_thread(void *arg)
     redisFree(redis);
     return NULL;
 }
-// void *polling_get_data_thread(void *arg)
-// {
-//     sqlite3 *db;
-//     sqlite3_open(modbus_mapping.db, &db);
-//     CREATE TABLE IF NOT EXISTS data_log(
-//         id INTEGER PRIMARY KEY AUTOINCREMENT,
-//         timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,
-//         rtu_id INTEGER,
-//         rtu_address INTEGER,
-//         value INTEGER);
-// }
+//====================================================================================================
+//======================== Thread 4: write polled values to table data_log ===========================
+//  flush when DATA_LOG_BATCH samples are buffered or the oldest one is DATA_LOG_FLUSH_MS old.
+//  one transaction per flush and multi-row INSERTs, WAL journal: few page writes on eMMC per batch
+#define DATA_LOG_INSERT "(strftime('%Y-%m-%d %H:%M:%f', ?, 'unixepoch'), ?, ?, ?)"
+
+//========================= Function: bind sample to INSERT, first parameter index ===================
+void data_log_bind(sqlite3_stmt *stmt, int index, const DataSample *sample)
+{
+    sqlite3_bind_double(stmt, index, sample->time_ms / 1000.0);
+    sqlite3_bind_int(stmt, index + 1, sample->rtu_id);
+    sqlite3_bind_int(stmt, index + 2, sample->rtu_address);
+    sqlite3_bind_int(stmt, index + 3, sample->value);
+}
+
+//========================= Function: prepare INSERT of rows samples =================================
+sqlite3_stmt *data_log_prepare(sqlite3 *db, int rows)
+{
+    char sql[64 + DATA_LOG_ROWS * (sizeof(DATA_LOG_INSERT) + 1)];
+    int len = sprintf(sql, "INSERT INTO data_log(timestamp, rtu_id, rtu_address, value) VALUES ");
+    for (int i = 0; i < rows; i++)
+    {
+        len += sprintf(sql + len, "%s%s", i ? "," : "", DATA_LOG_INSERT);
+    }
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "[RTU Server data log] Failed to prepare INSERT: %s\n", sqlite3_errmsg(db));
+    }
+    return stmt;
+}
+
+//========================= Function: write samples in one transaction ===============================
+// return 0 if committed, -1 if rolled back
+int data_log_write(sqlite3 *db, sqlite3_stmt *multi, sqlite3_stmt *single, const DataSample *samples, int count)
+{
+    int rc = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    int i = 0;
+    while (rc == SQLITE_OK && i < count)
+    {
+        sqlite3_stmt *stmt = count - i >= DATA_LOG_ROWS ? multi : single;
+        int rows = stmt == multi ? DATA_LOG_ROWS : 1;
+        for (int row = 0; row < rows; row++)
+        {
+            data_log_bind(stmt, 1 + 4 * row, &samples[i + row]);
+        }
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+        sqlite3_reset(stmt);
+        i += rows;
+    }
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    }
+    if (rc != SQLITE_OK)
+    {
+        fprintf(stderr, "[RTU Server data log] Failed to write %d samples: %s\n", count, sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+void *data_log_thread(void *arg)
+{
+    sqlite3 *db;
+    sqlite3_open("modbus_mapping.db", &db);
+    sqlite3_busy_timeout(db, 1000); // other threads and database_service.py use the same file
+    sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+    sqlite3_exec(db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL); // WAL: fsync at checkpoint only
+    sqlite3_exec(db,
+                 "CREATE TABLE IF NOT EXISTS data_log("
+                 "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                 "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP, "
+                 "rtu_id INTEGER, "
+                 "rtu_address INTEGER, "
+                 "value INTEGER);"
+                 "CREATE INDEX IF NOT EXISTS data_log_tag ON data_log(rtu_id, rtu_address, timestamp);",
+                 NULL, NULL, NULL);
+    sqlite3_stmt *multi = data_log_prepare(db, DATA_LOG_ROWS);
+    sqlite3_stmt *single = data_log_prepare(db, 1);
+    if (!multi || !single)
+    {
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    static DataSample batch[DATA_LOG_SIZE];
+    long long next_reload = now_ms() + RATE_LIMIT_RELOAD_S * 1000;
+    while (1)
+    {
+        if (now_ms() >= next_reload) // learned device profiles, same writer as data_log
+        {
+            load_device_profiles(db);
+            next_reload = now_ms() + RATE_LIMIT_RELOAD_S * 1000;
+        }
+
+        pthread_mutex_lock(&data_log_mutex);
+        while (data_log_count < DATA_LOG_BATCH && now_ms() < next_reload &&
+               (data_log_count == 0 || now_ms() < data_log_first_ms + DATA_LOG_FLUSH_MS))
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts); // pthread_cond_timedwait uses realtime clock
+            long long wait_ms = data_log_count ? data_log_first_ms + DATA_LOG_FLUSH_MS - now_ms() : DATA_LOG_FLUSH_MS;
+            ts.tv_sec += wait_ms / 1000;
+            ts.tv_nsec += (wait_ms % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&data_log_cond, &data_log_mutex, &ts);
+        }
+        int count = data_log_count;
+        for (int i = 0; i < count; i++)
+        {
+            batch[i] = data_log_buffer[(data_log_front + i) % DATA_LOG_SIZE];
+        }
+        data_log_front = (data_log_front + count) % DATA_LOG_SIZE;
+        data_log_count = 0;
+        pthread_mutex_unlock(&data_log_mutex);
+        if (count == 0)
+        {
+            continue; // woke up for the profile reload
+        }
+
+        int rc = data_log_write(db, multi, single, batch, count);
+        pthread_mutex_lock(&data_log_mutex);
+        if (rc == 0)
+        {
+            data_log_logged += count;
+        }
+        else
+        {
+            data_log_dropped += count;
+        }
+        pthread_mutex_unlock(&data_log_mutex);
+    }
+
+    sqlite3_finalize(multi);
+    sqlite3_finalize(single);
+    sqlite3_close(db);
+    return NULL;
+}
+
+//====================================================================================================
+//======================== Thread 5: publish changed tags (Redis channel modbus_data) ================
+//  {"tag_id": 60000, "rtu_id": 1, "function": 3, "address": 200, "time": 1700000000123, "values": [201, 202]}
+//  template tag adds "name": "voltage_l1", "value": 230.1
+//  queued updates are sent pipelined, one round trip per batch
+void *publish_tags_thread(void *arg)
+{
+    redisContext *redis = redisConnect("127.0.0.1", 6379);
+    if (redis == NULL || redis->err)
+    {
+        fprintf(stderr, "[RTU Server publish] Redis connection error !!!\n");
+        return NULL;
+    }
+
+    static TagUpdate batch[TAG_UPDATE_SIZE];
+    while (1)
+    {
+        pthread_mutex_lock(&tag_update_mutex);
+        while (tag_update_count == 0)
+        {
+            pthread_cond_wait(&tag_update_cond, &tag_update_mutex);
+        }
+        int count = tag_update_count;
+        for (int i = 0; i < count; i++)
+        {
+            batch[i] = tag_updates[(tag_update_front + i) % TAG_UPDATE_SIZE];
+        }
+        tag_update_front = (tag_update_front + count) % TAG_UPDATE_SIZE;
+        tag_update_count = 0;
+        pthread_mutex_unlock(&tag_update_mutex);
+
+        for (int i = 0; i < count; i++)
+        {
+            json_t *root = json_object();
+            json_t *values = json_array();
+            json_object_set_new(root, "tag_id", json_integer(batch[i].tag_id));
+            json_object_set_new(root, "rtu_id", json_integer(batch[i].rtu_id));
+            json_object_set_new(root, "function", json_integer(batch[i].function));
+            json_object_set_new(root, "address", json_integer(batch[i].address));
+            json_object_set_new(root, "time", json_integer(batch[i].time_ms));
+            for (int j = 0; j < batch[i].quantity; j++)
+            {
+                json_array_append_new(values, json_integer(batch[i].value[j]));
+            }
+            json_object_set_new(root, "values", values);
+            if (batch[i].type != TAG_RAW)
+            {
+                double value = tag_scaled_value(batch[i].type, batch[i].word_swap, batch[i].scale, batch[i].value);
+                json_object_set_new(root, "name", json_string(batch[i].name));
+                json_object_set_new(root, "value", isfinite(value) ? json_real(value) : json_null());
+            }
+            char *json_str = json_dumps(root, 0);
+            redisAppendCommand(redis, "PUBLISH modbus_data %s", json_str);
+            free(json_str);
+            json_decref(root);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            redisReply *reply;
+            if (redisGetReply(redis, (void **)&reply) != REDIS_OK)
+            {
+                fprintf(stderr, "[RTU Server publish] Redis error: %s !!!\n", redis->errstr);
+                redisFree(redis);
+                return NULL;
+            }
+            freeReplyObject(reply);
+        }
+        pthread_mutex_lock(&tag_update_mutex);
+        tag_updates_published += count;
+        pthread_mutex_unlock(&tag_update_mutex);
+    }
+
+    redisFree(redis);
+    return NULL;
+}
+
+//====================================================================================================
+//======================== Thread 6: publish stats (Redis key modbus_stats:rtu) ======================
+//  {"time": 1700000000, "ports": [{"port_id": 1, "device": "/dev/ttyUSB0", "queued": 0, "sent_requests": 120,
+//                                  "sent_polls": 3400, "missed_requests": 0, "missed_polls": 2, "retries": 4,
+//                                  "merged_requests": 0}],
+//   "tcp_devices": [{"device_id": 4, "address": "192.168.1.20", "connected": 2, "queued": 0,
+//                    "sent_requests": 800, "failed_requests": 0, "connects": 1, "sent_polls": 9000, "missed_polls": 0}],
+//   "slaves": [{"rtu_id": 3, "breaker": "open", "failures": 5, "next_probe_ms": 3800,
+//               "timeout_ms": 42, "ewma_ms": 18.5, "samples": 64}],
+//   "data_log": {"buffered": 120, "logged": 360000, "dropped": 0},
+//   "tag_updates": {"published": 5400, "dropped": 0}}
+//  only slaves with response times or failures are listed
+void *stats_thread(void *arg)
+{
+    redisContext *redis = redisConnect("127.0.0.1", 6379);
+    if (redis == NULL || redis->err)
+    {
+        fprintf(stderr, "[RTU Server stats] Redis connection error !!!\n");
+        return NULL;
+    }
+
+    while (1)
+    {
+        sleep(STATS_INTERVAL_S);
+
+        json_t *root = json_object();
+        json_t *ports = json_array();
+        json_t *slaves = json_array();
+        json_object_set_new(root, "time", json_integer(time(NULL)));
+
+        for (int i = 0; i < port_count; i++)
+        {
+            json_t *port = json_object();
+            json_object_set_new(port, "port_id", json_integer(serial_ports[i].port_id));
+            json_object_set_new(port, "device", json_string(serial_ports[i].device));
+            json_object_set_new(port, "queued", json_integer(queue_length(&serial_ports[i].queue)));
+            json_object_set_new(port, "sent_requests", json_integer(serial_ports[i].sent_requests));
+            json_object_set_new(port, "sent_polls", json_integer(serial_ports[i].sent_polls));
+            json_object_set_new(port, "missed_requests", json_integer(serial_ports[i].missed_requests));
+            json_object_set_new(port, "missed_polls", json_integer(serial_ports[i].missed_polls));
+            json_object_set_new(port, "retries", json_integer(serial_ports[i].retries));
+            json_object_set_new(port, "merged_requests", json_integer(serial_ports[i].merged_requests));
+            json_array_append_new(ports, port);
+        }
+
+        for (int rtu_id = 0; rtu_id < MAX_SLAVES; rtu_id++)
+        {
+            pthread_mutex_lock(&breaker_mutex);
+            CircuitBreaker breaker = slave_breakers[rtu_id];
+            pthread_mutex_unlock(&breaker_mutex);
+            pthread_mutex_lock(&latency_mutex);
+            SlaveLatency latency = slave_latency[rtu_id];
+            pthread_mutex_unlock(&latency_mutex);
+            pthread_mutex_lock(&profile_mutex);
+            DeviceProfile profile = device_profiles[rtu_id];
+            pthread_mutex_unlock(&profile_mutex);
+            if (latency.count == 0 && breaker.failures == 0)
+            {
+                continue;
+            }
+
+            json_t *slave = json_object();
+            json_object_set_new(slave, "rtu_id", json_integer(rtu_id));
+            json_object_set_new(slave, "breaker", json_string(breaker_name(breaker.state)));
+            json_object_set_new(slave, "failures", json_integer(breaker.failures));
+            if (breaker.state == BREAKER_OPEN)
+            {
+                long long wait = breaker.probe_ms - now_ms();
+                json_object_set_new(slave, "next_probe_ms", json_integer(wait > 0 ? wait : 0));
+            }
+            json_object_set_new(slave, "timeout_ms", json_integer(slave_timeout_ms(rtu_id)));
+            json_object_set_new(slave, "ewma_ms", json_real(latency.ewma_ms));
+            json_object_set_new(slave, "samples", json_integer(latency.count));
+            json_object_set_new(slave, "max_read", json_integer(profile.max_read ? profile.max_read : MAX_READ_REGISTERS));
+            json_object_set_new(slave, "frame_gap_ms", json_integer(profile.frame_gap_ms));
+            json_array_append_new(slaves, slave);
+        }
+        json_object_set_new(root, "ports", ports);
+
+        json_t *devices = json_array();
+        for (int i = 0; i < tcp_device_count; i++)
+        {
+            TcpDevice *tcp = &tcp_devices[i];
+            int open = 0;
+            for (int c = 0; c < tcp->connections; c++)
+            {
+                open += tcp->conns[c].state == TCP_OPEN; // read without lock, for display only
+            }
+            json_t *device = json_object();
+            json_object_set_new(device, "device_id", json_integer(tcp->device_id));
+            json_object_set_new(device, "address", json_string(tcp->ip));
+            json_object_set_new(device, "connected", json_integer(open));
+            json_object_set_new(device, "queued", json_integer(queue_length(&tcp->queue)));
+            json_object_set_new(device, "sent_requests", json_integer(tcp->sent_requests));
+            json_object_set_new(device, "failed_requests", json_integer(tcp->failed_requests));
+            json_object_set_new(device, "connects", json_integer(tcp->reconnects));
+            json_object_set_new(device, "sent_polls", json_integer(tcp->sent_polls));
+            json_object_set_new(device, "missed_polls", json_integer(tcp->missed_polls));
+            json_array_append_new(devices, device);
+        }
+        json_object_set_new(root, "tcp_devices", devices);
+        json_object_set_new(root, "slaves", slaves);
+
+        json_t *data_log = json_object();
+        pthread_mutex_lock(&data_log_mutex);
+        json_object_set_new(data_log, "buffered", json_integer(data_log_count));
+        json_object_set_new(data_log, "logged", json_integer(data_log_logged));
+        json_object_set_new(data_log, "dropped", json_integer(data_log_dropped));
+        pthread_mutex_unlock(&data_log_mutex);
+        json_object_set_new(root, "data_log", data_log);
+
+        json_t *updates = json_object();
+        pthread_mutex_lock(&tag_update_mutex);
+        json_object_set_new(updates, "published", json_integer(tag_updates_published));
+        json_object_set_new(updates, "dropped", json_integer(tag_updates_dropped));
+        pthread_mutex_unlock(&tag_update_mutex);
+        json_object_set_new(root, "tag_updates", updates);
+
+        char *json_str = json_dumps(root, 0);
+        redisReply *reply = redisCommand(redis, "SET modbus_stats:rtu %s", json_str);
+        if (reply)
+        {
+            freeReplyObject(reply);
+        }
+        free(json_str);
+        json_decref(root);
+    }
+
+    redisFree(redis);
+    return NULL;
+}
+
+//====================================================================================================
+//======================== Thread 7: discovery results (table device_info, key modbus_discovery:rtu) =
+//  {"time": 1700000000, "ports": [{"port_id": 1, "device": "/dev/ttyUSB0", "state": "running",
+//    "first_id": 1, "last_id": 247, "next_id": 120, "probed": 119, "timeout_ms": 36, "elapsed_ms": 5200,
+//    "found": [{"rtu_id": 3, "response_ms": 12, "slave_id": "03FF41"}]}]}
+//  a finished scan writes one device_info row per slave (port_id, unit_id), rows of earlier scans
+//  are updated. RTU IDs without rtu_route row are routed to the port; an RTU ID routed to another
+//  port or TCP device is reported, its slave can not be reached on this port
+const char *discovery_state_name(DiscoveryState state)
+{
+    return state == DISCOVERY_RUNNING ? "running" : state == DISCOVERY_IDLE ? "idle" : "done";
+}
+
+void discovery_save(sqlite3 *db, const SerialPort *port, const Discovery *d)
+{
+    sqlite3_stmt *update, *insert;
+    if (sqlite3_prepare_v2(db, "UPDATE device_info SET \"update\" = CURRENT_TIMESTAMP, slave_id = ?1, response_ms = ?2 "
+                               "WHERE port_id = ?3 AND unit_id = ?4", -1, &update, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "[RTU Server discovery] device_info: %s !!!\n", sqlite3_errmsg(db));
+        return;
+    }
+    sqlite3_prepare_v2(db, "INSERT INTO device_info (ip_address, tcp_port, device_type, slave_id, response_ms, port_id, unit_id) "
+                           "VALUES ('', 0, 'rtu', ?1, ?2, ?3, ?4)", -1, &insert, NULL);
+    sqlite3_stmt *route = NULL;
+    sqlite3_prepare_v2(db, "INSERT INTO rtu_route (rtu_id, port_id) SELECT ?1, ?2 "
+                           "WHERE NOT EXISTS (SELECT 1 FROM rtu_route WHERE rtu_id = ?1)", -1, &route, NULL);
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (int rtu_id = d->first_id; rtu_id <= d->last_id; rtu_id++)
+    {
+        if (!d->found[rtu_id])
+        {
+            continue;
+        }
+        char slave_id[2 * DISCOVERY_ID_BYTES + 1] = "";
+        for (int i = 0; i < d->slave_id_len[rtu_id]; i++)
+        {
+            sprintf(slave_id + 2 * i, "%02X", d->slave_id[rtu_id][i]);
+        }
+        sqlite3_stmt *stmt = update;
+        for (int pass = 0; pass < 2; pass++, stmt = insert)
+        {
+            sqlite3_bind_text(stmt, 1, slave_id, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_double(stmt, 2, d->response_ms[rtu_id]);
+            sqlite3_bind_int(stmt, 3, port->port_id);
+            sqlite3_bind_int(stmt, 4, rtu_id);
+            sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if (sqlite3_changes(db) > 0)
+            {
+                break; // row of earlier scan updated, or new row inserted
+            }
+        }
+        if (route)
+        {
+            sqlite3_bind_int(route, 1, rtu_id);
+            sqlite3_bind_int(route, 2, port->port_id);
+            if (sqlite3_step(route) == SQLITE_DONE && sqlite3_changes(db) > 0)
+            {
+                slave_port[rtu_id] = port - serial_ports; // requests and polls of rtu_id go to this port
+            }
+            else if (route_tcp_device(rtu_id) || route_request(rtu_id) != port)
+            {
+                printf("[RTU Server discovery] RTU_ID %d of %s is routed to another port or device, not reached here !!!\n",
+                       rtu_id, port->device);
+            }
+            sqlite3_reset(route);
+        }
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_finalize(update);
+    sqlite3_finalize(insert);
+    sqlite3_finalize(route);
+    printf("[RTU Server discovery] %d slaves of %s saved to device_info.\n", d->found_count, port->device);
+}
+
+void *discovery_thread(void *arg)
+{
+    sqlite3 *db;
+    sqlite3_open("modbus_mapping.db", &db);
+    sqlite3_busy_timeout(db, 5000);
+    const char *columns[] = {"port_id INTEGER", "unit_id INTEGER", "slave_id TEXT", "response_ms REAL"};
+    for (int i = 0; i < 4; i++) // same columns as database_service.init_db(), error if they exist
+    {
+        char sql[128];
+        snprintf(sql, sizeof(sql), "ALTER TABLE device_info ADD COLUMN %s", columns[i]);
+        sqlite3_exec(db, sql, NULL, NULL, NULL);
+    }
+    redisContext *redis = redisConnect("127.0.0.1", 6379);
+    if (redis == NULL || redis->err)
+    {
+        fprintf(stderr, "[RTU Server discovery] Redis connection error !!!\n");
+        return NULL;
+    }
+
+    static Discovery copy; // snapshot, scan goes on while it is saved and published
+    while (1)
+    {
+        usleep(DISCOVERY_PROGRESS_MS * 1000);
+
+        json_t *root = json_object();
+        json_t *ports = json_array();
+        json_object_set_new(root, "time", json_integer(time(NULL)));
+        int active = 0;
+        for (int i = 0; i < port_count; i++)
+        {
+            pthread_mutex_lock(&discovery_mutex);
+            copy = serial_ports[i].discovery;
+            if (serial_ports[i].discovery.state == DISCOVERY_DONE)
+            {
+                serial_ports[i].discovery.state = DISCOVERY_SAVED;
+            }
+            pthread_mutex_unlock(&discovery_mutex);
+            if (copy.state == DISCOVERY_IDLE)
+            {
+                continue;
+            }
+            if (copy.state == DISCOVERY_DONE)
+            {
+                discovery_save(db, &serial_ports[i], &copy);
+            }
+            active += copy.state == DISCOVERY_RUNNING || copy.state == DISCOVERY_DONE;
+
+            json_t *port = json_object();
+            json_object_set_new(port, "port_id", json_integer(serial_ports[i].port_id));
+            json_object_set_new(port, "device", json_string(serial_ports[i].device));
+            json_object_set_new(port, "state", json_string(discovery_state_name(copy.state)));
+            json_object_set_new(port, "first_id", json_integer(copy.first_id));
+            json_object_set_new(port, "last_id", json_integer(copy.last_id));
+            json_object_set_new(port, "next_id", json_integer(copy.next_id));
+            json_object_set_new(port, "probed", json_integer(copy.probed));
+            json_object_set_new(port, "timeout_ms", json_integer(copy.timeout_ms));
+            json_object_set_new(port, "elapsed_ms", json_integer((copy.finished_ms ? copy.finished_ms : now_ms()) - copy.started_ms));
+            json_t *found = json_array();
+            for (int rtu_id = copy.first_id; rtu_id <= copy.last_id; rtu_id++)
+            {
+                if (!copy.found[rtu_id])
+                {
+                    continue;
+                }
+                char slave_id[2 * DISCOVERY_ID_BYTES + 1] = "";
+                for (int b = 0; b < copy.slave_id_len[rtu_id]; b++)
+                {
+                    sprintf(slave_id + 2 * b, "%02X", copy.slave_id[rtu_id][b]);
+                }
+                json_t *slave = json_object();
+                json_object_set_new(slave, "rtu_id", json_integer(rtu_id));
+                json_object_set_new(slave, "response_ms", json_real(copy.response_ms[rtu_id]));
+                json_object_set_new(slave, "slave_id", json_string(slave_id));
+                json_array_append_new(found, slave);
+            }
+            json_object_set_new(port, "found", found);
+            json_array_append_new(ports, port);
+        }
+        json_object_set_new(root, "ports", ports);
+
+        if (active) // last state stays in Redis after the scan
+        {
+            char *json_str = json_dumps(root, 0);
+            redisReply *reply = redisCommand(redis, "SET modbus_discovery:rtu %s", json_str);
+            if (reply)
+            {
+                freeReplyObject(reply);
+            }
+            free(json_str);
+        }
+        json_decref(root);
+    }
+
+    redisFree(redis);
+    return NULL;
+}
+
 //====================================================================================================
 //======================== Main: create threads and run ==============================================
 int main()
 {
-    pthread_t request_thread, command_thread, response_thread; // polling_thread; // contain ID of threads
+    pthread_t request_thread, response_thread, data_log_tid, publish_tid, stats_tid, discovery_tid; // contain ID of threads
+
+    sqlite3 *db;
+    sqlite3_open("modbus_mapping.db", &db);
+    load_serial_ports(db); // before any thread uses the queues
+    load_tcp_devices(db);
+    load_device_profiles(db); // before poll plans compile, data_log_thread() reloads them
+    sqlite3_close(db);
 
     pthread_create(&request_thread, NULL, receive_request_thread, NULL);
-    pthread_create(&command_thread, NULL, send_command_thread, NULL);
+#if SERIAL_ENGINE_EPOLL
+    pthread_t engine_thread;
+    pthread_create(&engine_thread, NULL, serial_engine_thread, NULL);
+#else
+    for (int i = 0; i < port_count; i++)
+    {
+        pthread_create(&serial_ports[i].thread, NULL, send_command_thread, &serial_ports[i]);
+    }
+#endif
+    pthread_t tcp_thread;
+    if (tcp_device_count > 0)
+    {
+        pthread_create(&tcp_thread, NULL, tcp_engine_thread, NULL);
+    }
     pthread_create(&response_thread, NULL, send_response_thread, NULL);
-    // pthread_create(&polling_thread, NULL, polling_get_data_thread, NULL);
+    pthread_create(&data_log_tid, NULL, data_log_thread, NULL);
+    pthread_create(&publish_tid, NULL, publish_tags_thread, NULL);
+    pthread_create(&stats_tid, NULL, stats_thread, NULL);
+    pthread_create(&discovery_tid, NULL, discovery_thread, NULL);
 
     pthread_join(request_thread, NULL);
-    pthread_join(command_thread, NULL);
+#if SERIAL_ENGINE_EPOLL
+    pthread_join(engine_thread, NULL);
+#else
+    for (int i = 0; i < port_count; i++)
+    {
+        pthread_join(serial_ports[i].thread, NULL);
+    }
+#endif
+    if (tcp_device_count > 0)
+    {
+        pthread_join(tcp_thread, NULL);
+    }
     pthread_join(response_thread, NULL);
-    // pthread_join(polling_thread, NULL);
+    pthread_join(data_log_tid, NULL);
+    pthread_join(publish_tid, NULL);
+    pthread_join(stats_tid, NULL);
+    pthread_join(discovery_tid, NULL);
 
     return 0;
 }
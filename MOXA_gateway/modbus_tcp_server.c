@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,13 +11,51 @@
 #include <sys/types.h>
 #include <jansson.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>   // reactor for client sockets
+#include <sys/eventfd.h> // wake up reactor from other threads
+#include <sys/uio.h>     // writev
+#include <time.h>        // clock_gettime
 #include <modbus/modbus.h>
 #include "write_log.h" // include write_log function
 
+#define USE_TLS 0                 // 1: also accept Modbus/TCP Security (TLS) clients on TLS_PORT
+#define TLS_PORT 1802             // TLS port for Cloud connection
+#define TLS_CERT_FILE "server.crt"
+#define TLS_KEY_FILE "server.key"
+#define TLS_CA_FILE "ca.crt"      // if this file exists, clients must have a certificate signed by it
+
+#if USE_TLS
+#include <openssl/ssl.h> // link with -lssl -lcrypto
+#include <openssl/err.h>
+#endif
+
 #define PORT 1502                 // TCP port for Cloud connection
+#define UDP_PORT 1502             // UDP port for Cloud connection (Modbus/UDP, one request per datagram)
+#define UDP_BATCH 32              // datagrams per recvmmsg/sendmmsg call
+#define UDP_OUT_QUEUE 256         // response datagrams waiting for sendmmsg
+#define UDP_CLIENT -1             // client_sock value of requests received by UDP
 #define CLOUD_ADDRESS "127.0.0.1" // IP address of Cloud server
 #define BUFFER_SIZE 256           // Buffer size for TCP packets
 #define MAX_QUEUE 100             // number of requests in queue
+#define REQUEST_SIZE 14           // request packet: 7 fields x 2 bytes
+#define MAX_DATA_WORDS 125        // write data after request packet (FC16, FC22, FC23)
+#define RESPONSE_SIZE 8           // response packet for Cloud
+#define MAX_CLIENT_FD 1024        // client sockets with fd >= MAX_CLIENT_FD are refused
+#define OUT_QUEUE_SIZE 4096       // outbound bytes buffered per client
+#define MAX_EVENTS 64             // epoll events per wakeup
+#define MAX_CONNECTIONS 64        // open client sessions in total
+#define MAX_CONNECTIONS_PER_IP 8  // open client sessions from one source IP
+#define IDLE_TIMEOUT_MS 60000     // close session without traffic for 60s
+#define PENDING_TIMEOUT_MS 5000   // answer exception 0x0B if RTU server has not replied after 5s
+#define MAX_PENDING 100           // requests waiting for RTU server
+
+// ===== Modbus exception codes used in response packets =====
+#define EXCEPTION_ILLEGAL_DATA_ADDRESS 0x02
+#define EXCEPTION_ILLEGAL_DATA_VALUE 0x03
+#define EXCEPTION_SERVER_BUSY 0x06
+#define EXCEPTION_TARGET_NO_RESPONSE 0x0B
 int lookup_mapped_address(sqlite3 *db, int rtu_id, int tcp_address);
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;         // declare mutex for queue access (mutex = mutual exclusion lock))
@@ -26,6 +65,14 @@ int queue_head_index = 0;                                  // head index
 int queue_final_index = 0;                                 // final index
 int pending_count = 0;                                     // number of responses pending
 
+// ===== where to send the response: TCP session or UDP peer =====
+typedef struct
+{
+    int client_sock;             // session fd, UDP_CLIENT for Modbus/UDP
+    unsigned int session_id;     // session owning client_sock when request was received
+    struct sockaddr_in udp_peer; // source address of UDP request
+} ClientAddress;
+
 // ===== declare queue for request packets - FIFO structure =====
 typedef struct
 // structure for modbus TCP packet
@@ -37,26 +84,92 @@ typedef struct
     int address;
     int function;
     int quantity;
-    int client_sock;
+    int data_count;                 // words in data, length field = 6 + 2 * data_count
+    uint16_t data[MAX_DATA_WORDS];  // FC16: values, FC22: OR mask, FC23: write address, write quantity, values
+    ClientAddress client;
+    long long received_ms; // client waits PENDING_TIMEOUT_MS from here
 } RequestPacket;
 RequestPacket request_queue[MAX_QUEUE];
 
 // ===== array contain RTU feedback for TCP server =====
+// transaction_id is assigned by gateway (unique while pending), client_transaction_id is sent back to client
 typedef struct
 {
     int transaction_id;
-    int client_sock;
+    int client_transaction_id;
+    ClientAddress client;
+    int rtu_id;
+    int address;
+    int function;
+    long long deadline_ms; // exception 0x0B is sent to client after this time
 } corresponding_address;
-corresponding_address pending_responses[100]; //  save response from RTU server
+corresponding_address pending_responses[MAX_PENDING]; //  save response from RTU server
+int next_transaction_id = 1;                          // gateway transaction id, only used by process thread
+
+// ===== client session: one per connected socket, index = fd =====
+// in_buf is only touched by the reactor thread,
+// out_buf (ring buffer) is filled by response thread and drained by reactor, protected by session_mutex
+typedef struct
+{
+    int open;
+    unsigned int id;                 // changes every time the fd is reused
+    in_addr_t peer_ip;               // source IP, for MAX_CONNECTIONS_PER_IP
+    long long last_active_ms;        // last byte received or sent
+    int closing;                     // close as soon as out_buf is sent
+#if USE_TLS
+    SSL *ssl;                        // NULL for plain TCP client
+    int handshaking;                 // TLS handshake not finished yet
+    int ktls_send;                   // kernel encrypts: out_buf is written with writev like plain TCP
+#endif
+    uint8_t in_buf[BUFFER_SIZE + REQUEST_SIZE];
+    int in_len;
+    uint8_t out_buf[OUT_QUEUE_SIZE];
+    int out_head;                    // first byte not sent yet
+    int out_len;                     // bytes waiting in out_buf
+    int flush_pending;               // new bytes queued, reactor has to write
+    int overflow;                    // client too slow, out_buf full -> close
+    int want_out;                    // EPOLLOUT registered
+} ClientSession;
+ClientSession sessions[MAX_CLIENT_FD];
+pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned int next_session_id = 1;
+int reactor_epfd = -1;
+int reactor_wake_fd = -1; // eventfd, written when out_buf of any session gets data
+int spare_fd = -1;        // closed to accept and drop a client when the process is out of fds
+int paused_listen_fd[2] = {-1, -1}; // listen fds taken out of epoll after accept failed, re-armed by session_reap
+#if USE_TLS
+SSL_CTX *tls_ctx = NULL;
+#endif
+
+// ===== Modbus/UDP: responses waiting for sendmmsg, protected by udp_mutex =====
+typedef struct
+{
+    struct sockaddr_in peer;
+    uint8_t data[RESPONSE_SIZE];
+    int len;
+} UdpDatagram;
+UdpDatagram udp_out[UDP_OUT_QUEUE];
+int udp_out_head = 0;
+int udp_out_len = 0;
+int udp_want_out = 0; // EPOLLOUT registered on udp_fd
+int udp_fd = -1;
+pthread_mutex_t udp_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // ===== Function: add new request into queue =====
-void add_queue(RequestPacket new_pkt)
+// return -1 if queue is full, the request is not queued
+int add_queue(RequestPacket new_pkt)
 {
     pthread_mutex_lock(&mutex);                              // lock before writing into Queue
+    if ((queue_final_index + 1) % MAX_QUEUE == queue_head_index)
+    {
+        pthread_mutex_unlock(&mutex);
+        return -1; // writing would overwrite the oldest request
+    }
     request_queue[queue_final_index] = new_pkt;              // writing new packet to queue at rear position
     queue_final_index = (queue_final_index + 1) % MAX_QUEUE; // increase index, % MAX_QUEUE help to return to queue_rear = 0 (index =0)
     pthread_cond_signal(&cond_var);                          // announce for thread is waiting
     pthread_mutex_unlock(&mutex);                            // unlock
+    return 0;
 }
 
 //=====================================================================================================
@@ -75,12 +188,702 @@ RequestPacket take_queue()
     return next_packet;
 }
 
-// ===== thread 1: receive request packet from Cloud =====
+// ===== Function: monotonic time in ms =====
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#if USE_TLS
+// ===== Function: create TLS context: certificate, session tickets, kernel TLS =====
+// return 0 if ready, -1 if certificate or key can not be loaded
+int tls_init()
+{
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls_ctx)
+    {
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS); // kernel TLS after handshake when kernel has tls module
+#endif
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // resumption: TLS 1.3 tickets + TLS 1.2 session cache, clients reconnecting skip the full handshake
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char *)"moxa_gateway", 12);
+    SSL_CTX_set_num_tickets(tls_ctx, 1);
+
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, TLS_CERT_FILE) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, TLS_KEY_FILE, SSL_FILETYPE_PEM) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+    if (access(TLS_CA_FILE, R_OK) == 0) // Modbus/TCP Security: mutual authentication
+    {
+        SSL_CTX_load_verify_locations(tls_ctx, TLS_CA_FILE, NULL);
+        SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+    }
+    return 0;
+}
+#endif
+
+// ===== Function: queue bytes for client, never blocks (called from response thread) =====
+// return 0 if queued, -1 if the session is gone or its queue is full
+int session_send(int client_sock, unsigned int session_id, const uint8_t *data, int len)
+{
+    int rc = -1;
+    int wake = 0;
+    if (client_sock < 0 || client_sock >= MAX_CLIENT_FD)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&session_mutex);
+    ClientSession *sess = &sessions[client_sock];
+    if (sess->open && sess->id == session_id)
+    {
+        if (sess->out_len + len > OUT_QUEUE_SIZE)
+        {
+            sess->overflow = 1; // slow consumer: only this client is dropped
+        }
+        else
+        {
+            for (int i = 0; i < len; i++)
+            {
+                sess->out_buf[(sess->out_head + sess->out_len + i) % OUT_QUEUE_SIZE] = data[i];
+            }
+            sess->out_len += len;
+            rc = 0;
+        }
+        sess->flush_pending = 1;
+        wake = 1;
+    }
+    pthread_mutex_unlock(&session_mutex);
+
+    if (wake)
+    {
+        uint64_t one = 1;
+        if (write(reactor_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) // eventfd is non-blocking
+        {
+            perror("[TCP Server session] wake reactor");
+        }
+    }
+    return rc;
+}
+
+// ===== Function: queue response datagram for UDP client, never blocks =====
+int udp_send(const struct sockaddr_in *peer, const uint8_t *data, int len)
+{
+    pthread_mutex_lock(&udp_mutex);
+    if (udp_out_len >= UDP_OUT_QUEUE)
+    {
+        pthread_mutex_unlock(&udp_mutex);
+        printf("[TCP Server UDP] Send queue full, response dropped !!!\n");
+        return -1;
+    }
+    UdpDatagram *dgram = &udp_out[(udp_out_head + udp_out_len) % UDP_OUT_QUEUE];
+    dgram->peer = *peer;
+    memcpy(dgram->data, data, len);
+    dgram->len = len;
+    udp_out_len++;
+    pthread_mutex_unlock(&udp_mutex);
+
+    uint64_t one = 1;
+    if (write(reactor_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        perror("[TCP Server UDP] wake reactor");
+    }
+    return 0;
+}
+
+// ===== Function: queue response for TCP or UDP client =====
+int client_send(const ClientAddress *client, const uint8_t *data, int len)
+{
+    if (client->client_sock == UDP_CLIENT)
+    {
+        return udp_send(&client->udp_peer, data, len);
+    }
+    return session_send(client->client_sock, client->session_id, data, len);
+}
+
+// ===== Function: queue exception response for client =====
+// same layout as value response: function | 0x80, exception code in value field
+int send_exception(const ClientAddress *client, int transaction_id, int rtu_id, int address, int function, int code)
+{
+    uint8_t response[RESPONSE_SIZE] = {transaction_id, rtu_id, address, function | 0x80, 0, code, 0, 0};
+    printf("[TCP Server exception] transaction_id %d RTU ID %d -> exception 0x%02X\n", transaction_id, rtu_id, code);
+    return client_send(client, response, RESPONSE_SIZE);
+}
+
+// ===== Function: close client session (reactor thread only) =====
+void session_close(int client_sock)
+{
+    pthread_mutex_lock(&session_mutex);
+    sessions[client_sock].open = 0;
+    sessions[client_sock].out_len = 0;
+    sessions[client_sock].flush_pending = 0;
+    pthread_mutex_unlock(&session_mutex);
+
+#if USE_TLS
+    if (sessions[client_sock].ssl)
+    {
+        SSL_shutdown(sessions[client_sock].ssl); // best effort close_notify, socket is non-blocking
+        SSL_free(sessions[client_sock].ssl);
+        sessions[client_sock].ssl = NULL;
+    }
+#endif
+    epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, client_sock, NULL);
+    close(client_sock);
+}
+
+// ===== Function: set epoll events of client socket (reactor thread only) =====
+void session_watch(int client_sock, int want_out)
+{
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.fd = client_sock;
+    epoll_ctl(reactor_epfd, EPOLL_CTL_MOD, client_sock, &ev);
+    sessions[client_sock].want_out = want_out;
+}
+
+// ===== Function: write to client like writev, through TLS if the kernel does not encrypt =====
+ssize_t session_write(int client_sock, const struct iovec *iov, int iovcnt)
+{
+#if USE_TLS
+    ClientSession *sess = &sessions[client_sock];
+    if (sess->ssl && !sess->ktls_send)
+    {
+        int n = SSL_write(sess->ssl, iov[0].iov_base, iov[0].iov_len); // second piece goes on next call
+        if (n > 0)
+        {
+            return n;
+        }
+        int err = SSL_get_error(sess->ssl, n);
+        errno = (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? EAGAIN : EIO;
+        return -1;
+    }
+#endif
+    return writev(client_sock, iov, iovcnt);
+}
+
+// ===== Function: read from client like recv, through TLS for TLS sessions =====
+ssize_t session_recv(int client_sock, uint8_t *buf, int len)
+{
+#if USE_TLS
+    ClientSession *sess = &sessions[client_sock];
+    if (sess->ssl)
+    {
+        int n = SSL_read(sess->ssl, buf, len);
+        if (n > 0)
+        {
+            return n;
+        }
+        int err = SSL_get_error(sess->ssl, n);
+        if (err == SSL_ERROR_ZERO_RETURN)
+        {
+            return 0; // close_notify from client
+        }
+        errno = (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? EAGAIN : EIO;
+        return -1;
+    }
+#endif
+    return recv(client_sock, buf, len, 0);
+}
+
+// ===== Function: write queued bytes with writev (reactor thread only) =====
+// the socket is non-blocking, so holding session_mutex here never waits for the network
+void session_flush(int client_sock)
+{
+    ClientSession *sess = &sessions[client_sock];
+    int failed = 0;
+
+#if USE_TLS
+    if (sess->handshaking)
+    {
+        return; // flushed when handshake is done
+    }
+#endif
+    pthread_mutex_lock(&session_mutex);
+    sess->flush_pending = 0;
+    if (sess->overflow)
+    {
+        failed = 1;
+    }
+    while (!failed && sess->out_len > 0)
+    {
+        struct iovec iov[2]; // ring buffer may wrap -> two pieces
+        int first = OUT_QUEUE_SIZE - sess->out_head;
+        if (first > sess->out_len)
+        {
+            first = sess->out_len;
+        }
+        iov[0].iov_base = sess->out_buf + sess->out_head;
+        iov[0].iov_len = first;
+        iov[1].iov_base = sess->out_buf;
+        iov[1].iov_len = sess->out_len - first;
+
+        ssize_t sent = session_write(client_sock, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if (sent > 0)
+        {
+            sess->out_head = (sess->out_head + sent) % OUT_QUEUE_SIZE;
+            sess->out_len -= sent;
+            sess->last_active_ms = now_ms();
+        }
+        else if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (sent < 0 && errno == EAGAIN)
+        {
+            break; // kernel buffer full, wait for EPOLLOUT
+        }
+        else
+        {
+            failed = 1;
+        }
+    }
+    int want_out = sess->out_len > 0;
+    int done = sess->closing && !want_out;
+    pthread_mutex_unlock(&session_mutex);
+
+    if (failed)
+    {
+        printf("[TCP Server session] Client socket %d closed (send failed or too slow) !!!\n", client_sock);
+        session_close(client_sock);
+        return;
+    }
+    if (done)
+    {
+        session_close(client_sock); // exception reply is sent, now close
+        return;
+    }
+    if (want_out != sess->want_out)
+    {
+        session_watch(client_sock, want_out);
+    }
+}
+
+#if USE_TLS
+// ===== Function: continue TLS handshake (reactor thread only) =====
+// return 1 when handshake is finished, 0 if waiting for network, -1 if session was closed
+int session_handshake(int client_sock)
+{
+    ClientSession *sess = &sessions[client_sock];
+    int rc = SSL_do_handshake(sess->ssl);
+    if (rc == 1)
+    {
+        sess->handshaking = 0;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        sess->ktls_send = BIO_get_ktls_send(SSL_get_wbio(sess->ssl)) > 0;
+#endif
+        printf("[TCP Server TLS] Client socket %d: %s%s, kTLS send %s\n", client_sock, SSL_get_version(sess->ssl),
+               SSL_session_reused(sess->ssl) ? " resumed" : "", sess->ktls_send ? "on" : "off");
+        session_watch(client_sock, 0);
+        session_flush(client_sock); // responses queued during handshake
+        return 1;
+    }
+
+    int err = SSL_get_error(sess->ssl, rc);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        if ((err == SSL_ERROR_WANT_WRITE) != sess->want_out)
+        {
+            session_watch(client_sock, err == SSL_ERROR_WANT_WRITE);
+        }
+        return 0;
+    }
+    printf("[TCP Server TLS] Handshake failed on client socket %d !!!\n", client_sock);
+    ERR_clear_error();
+    session_close(client_sock);
+    return -1;
+}
+#endif
+
+// ===== Function: parse request packet at buffer[0..len) =====
+// FC16, FC22 and FC23 carry write data after the 7 fields, the length field counts the bytes after
+// itself like in the MBAP header. Other functions are always REQUEST_SIZE bytes.
+// return size of the packet, 0 if more bytes are needed, -1 if invalid (fields are filled for the exception)
+int parse_request_packet(const uint8_t *buffer, int len, RequestPacket *packet)
+{
+    if (len < REQUEST_SIZE)
+    {
+        return 0;
+    }
+    packet->transaction_id = (buffer[0] << 8) | buffer[1];
+    packet->protocol_id = (buffer[2] << 8) | buffer[3];
+    packet->length = (buffer[4] << 8) | buffer[5];
+    packet->rtu_id = (buffer[6] << 8) | buffer[7];
+    packet->address = (buffer[8] << 8) | buffer[9];
+    packet->function = (buffer[10] << 8) | buffer[11];
+    packet->quantity = (buffer[12] << 8) | buffer[13];
+    packet->data_count = 0;
+    if (packet->protocol_id != 0)
+    {
+        return -1;
+    }
+    if (packet->function != 16 && packet->function != 22 && packet->function != 23)
+    {
+        return REQUEST_SIZE;
+    }
+    int data_bytes = packet->length - 6;
+    if (data_bytes < 2 || data_bytes > 2 * MAX_DATA_WORDS || data_bytes % 2 != 0)
+    {
+        return -1;
+    }
+    if (len < REQUEST_SIZE + data_bytes)
+    {
+        return 0;
+    }
+    packet->data_count = data_bytes / 2;
+    for (int i = 0; i < packet->data_count; i++)
+    {
+        packet->data[i] = (buffer[REQUEST_SIZE + 2 * i] << 8) | buffer[REQUEST_SIZE + 2 * i + 1];
+    }
+    return REQUEST_SIZE + data_bytes;
+}
+
+// ===== Function: read bytes from client and queue complete request packets (reactor thread only) =====
+void session_read(int client_sock)
+{
+    ClientSession *sess = &sessions[client_sock];
+
+    while (1)
+    {
+        int bytes = session_recv(client_sock, sess->in_buf + sess->in_len, sizeof(sess->in_buf) - sess->in_len);
+        if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            session_close(client_sock); // client closed connection or error
+            return;
+        }
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break; // EAGAIN: nothing more to read
+        }
+        sess->in_len += bytes;
+        sess->last_active_ms = now_ms();
+        if (sess->closing)
+        {
+            sess->in_len = 0; // ignore everything after invalid packet
+            continue;
+        }
+
+        int offset = 0;
+        while (sess->in_len - offset >= REQUEST_SIZE) // default modbus TCP packet length 14 bytes
+        {
+            RequestPacket next_packet;
+            int size = parse_request_packet(sess->in_buf + offset, sess->in_len - offset, &next_packet);
+            if (size == 0)
+            {
+                break; // write data not complete yet
+            }
+            printf("[TCP Server receive packet] Received packet from Cloud\n");
+            next_packet.client.client_sock = client_sock;
+            next_packet.client.session_id = sess->id;
+            next_packet.received_ms = sess->last_active_ms;
+            if (size < 0) // not a Modbus packet, stream is out of sync -> answer and close
+            {
+                printf("[TCP Server receive packet] Invalid packet !!!\n");
+                send_exception(&next_packet.client, next_packet.transaction_id, next_packet.rtu_id, next_packet.address,
+                               next_packet.function, EXCEPTION_ILLEGAL_DATA_VALUE);
+                sess->closing = 1;
+                offset = sess->in_len;
+                break;
+            }
+            offset += size;
+            if (add_queue(next_packet) < 0)
+            {
+                printf("[TCP Server receive packet] Queue full, transaction ID %d rejected !!!\n", next_packet.transaction_id);
+                send_exception(&next_packet.client, next_packet.transaction_id, next_packet.rtu_id, next_packet.address,
+                               next_packet.function, EXCEPTION_SERVER_BUSY);
+            }
+            // write_log_log("write_log.log", "INFO", "Received packet: transaction_id=%d, rtu_id=%d, address=%d, function=%d, quantity=%d",
+            //           next_packet.transaction_id, next_packet.rtu_id, next_packet.address, next_packet.function, next_packet.quantity);
+        }
+        memmove(sess->in_buf, sess->in_buf + offset, sess->in_len - offset); // keep incomplete packet
+        sess->in_len -= offset;
+    }
+}
+
+// ===== Function: accept all waiting clients (reactor thread only) =====
+// use_tls: listenfd is TLS_PORT, session starts with TLS handshake
+void session_accept(int listenfd, int use_tls)
+{
+    while (1)
+    {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        int client_sock = accept4(listenfd, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK);
+        if (client_sock < 0 && (errno == EINTR || errno == ECONNABORTED))
+        {
+            continue;
+        }
+        if (client_sock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return; // no more clients waiting
+        }
+        if (client_sock < 0 && (errno == EMFILE || errno == ENFILE) && spare_fd >= 0)
+        {
+            // client stays in the backlog and listenfd readable: free the spare fd to take it off and drop it
+            // (accept fails with EMFILE also when no client is waiting)
+            int err = errno;
+            close(spare_fd);
+            client_sock = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+            if (client_sock >= 0)
+            {
+                close(client_sock);
+            }
+            spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (client_sock < 0)
+            {
+                return;
+            }
+            printf("[TCP Server session] accept: %s, connection dropped !!!\n", strerror(err));
+            continue;
+        }
+        if (client_sock < 0)
+        {
+            // ENOBUFS, ENOMEM, no spare fd: stop watching listenfd until next session_reap
+            printf("[TCP Server session] accept: %s, listening paused !!!\n", strerror(errno));
+            struct epoll_event ev = {0};
+            ev.data.fd = listenfd;
+            epoll_ctl(reactor_epfd, EPOLL_CTL_MOD, listenfd, &ev);
+            paused_listen_fd[use_tls ? 1 : 0] = listenfd;
+            return;
+        }
+
+        int total = 0, same_ip = 0;
+        for (int i = 0; i < MAX_CLIENT_FD; i++)
+        {
+            if (sessions[i].open)
+            {
+                total++;
+                same_ip += sessions[i].peer_ip == peer.sin_addr.s_addr;
+            }
+        }
+        if (client_sock >= MAX_CLIENT_FD || total >= MAX_CONNECTIONS || same_ip >= MAX_CONNECTIONS_PER_IP)
+        {
+            printf("[TCP Server session] Too many clients from %s (%d total, %d this IP), connection refused !!!\n",
+                   inet_ntoa(peer.sin_addr), total, same_ip);
+            close(client_sock);
+            continue;
+        }
+
+        ClientSession *sess = &sessions[client_sock];
+        pthread_mutex_lock(&session_mutex);
+        sess->open = 1;
+        sess->id = next_session_id++;
+        sess->in_len = 0;
+        sess->out_head = 0;
+        sess->out_len = 0;
+        sess->flush_pending = 0;
+        sess->overflow = 0;
+        sess->want_out = 0;
+        sess->closing = 0;
+        sess->peer_ip = peer.sin_addr.s_addr;
+        sess->last_active_ms = now_ms();
+#if USE_TLS
+        sess->ssl = NULL;
+        sess->handshaking = 0;
+        sess->ktls_send = 0;
+        if (use_tls)
+        {
+            sess->ssl = SSL_new(tls_ctx);
+            SSL_set_fd(sess->ssl, client_sock);
+            SSL_set_accept_state(sess->ssl);
+            sess->handshaking = 1;
+        }
+#else
+        (void)use_tls;
+#endif
+        pthread_mutex_unlock(&session_mutex);
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.fd = client_sock;
+        epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, client_sock, &ev);
+    }
+}
+
+// ===== Function: receive Modbus/UDP requests, up to UDP_BATCH datagrams per call (reactor thread only) =====
+void udp_read()
+{
+    static uint8_t buffers[UDP_BATCH][BUFFER_SIZE + REQUEST_SIZE];
+    static struct sockaddr_in peers[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+
+    while (1)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++)
+        {
+            iovs[i].iov_base = buffers[i];
+            iovs[i].iov_len = sizeof(buffers[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &peers[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        }
+
+        int count = recvmmsg(udp_fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (count <= 0)
+        {
+            return; // EAGAIN: no more datagrams
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (msgs[i].msg_len < REQUEST_SIZE)
+            {
+                continue; // too short for a request packet, nobody to answer reliably
+            }
+            RequestPacket next_packet;
+            int size = parse_request_packet(buffers[i], msgs[i].msg_len, &next_packet);
+            next_packet.client.client_sock = UDP_CLIENT;
+            next_packet.client.session_id = 0;
+            next_packet.client.udp_peer = peers[i];
+            next_packet.received_ms = now_ms();
+            if (size <= 0) // invalid or write data missing, one datagram holds the whole packet
+            {
+                send_exception(&next_packet.client, next_packet.transaction_id, next_packet.rtu_id, next_packet.address,
+                               next_packet.function, EXCEPTION_ILLEGAL_DATA_VALUE);
+                continue;
+            }
+            if (add_queue(next_packet) < 0)
+            {
+                printf("[TCP Server UDP] Queue full, transaction ID %d rejected !!!\n", next_packet.transaction_id);
+                send_exception(&next_packet.client, next_packet.transaction_id, next_packet.rtu_id, next_packet.address,
+                               next_packet.function, EXCEPTION_SERVER_BUSY);
+            }
+        }
+        if (count < UDP_BATCH)
+        {
+            return;
+        }
+    }
+}
+
+// ===== Function: send queued response datagrams with sendmmsg (reactor thread only) =====
+void udp_flush()
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+
+    pthread_mutex_lock(&udp_mutex); // udp_fd is non-blocking, lock is never held while waiting
+    while (udp_out_len > 0)
+    {
+        int count = 0;
+        memset(msgs, 0, sizeof(msgs));
+        while (count < UDP_BATCH && count < udp_out_len)
+        {
+            UdpDatagram *dgram = &udp_out[(udp_out_head + count) % UDP_OUT_QUEUE];
+            iovs[count].iov_base = dgram->data;
+            iovs[count].iov_len = dgram->len;
+            msgs[count].msg_hdr.msg_iov = &iovs[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            msgs[count].msg_hdr.msg_name = &dgram->peer;
+            msgs[count].msg_hdr.msg_namelen = sizeof(dgram->peer);
+            count++;
+        }
+
+        int sent = sendmmsg(udp_fd, msgs, count, MSG_DONTWAIT);
+        if (sent < 0 && errno == EAGAIN)
+        {
+            break; // socket buffer full, wait for EPOLLOUT
+        }
+        if (sent <= 0)
+        {
+            sent = 1; // datagram can not be sent (e.g. unreachable peer), drop it
+        }
+        udp_out_head = (udp_out_head + sent) % UDP_OUT_QUEUE;
+        udp_out_len -= sent;
+    }
+    int want_out = udp_out_len > 0;
+    pthread_mutex_unlock(&udp_mutex);
+
+    if (want_out != udp_want_out)
+    {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+        ev.data.fd = udp_fd;
+        epoll_ctl(reactor_epfd, EPOLL_CTL_MOD, udp_fd, &ev);
+        udp_want_out = want_out;
+    }
+}
+
+// ===== Function: answer lost replies, close idle sessions, listen again (reactor thread, every second) =====
+void session_reap()
+{
+    corresponding_address expired[MAX_PENDING];
+    int expired_count = 0;
+    long long now = now_ms();
+
+    pthread_mutex_lock(&pending_mutex);
+    int kept = 0;
+    for (int i = 0; i < pending_count; i++)
+    {
+        if (pending_responses[i].deadline_ms <= now)
+        {
+            expired[expired_count++] = pending_responses[i];
+        }
+        else
+        {
+            pending_responses[kept++] = pending_responses[i];
+        }
+    }
+    pending_count = kept;
+    pthread_mutex_unlock(&pending_mutex);
+
+    for (int i = 0; i < expired_count; i++)
+    {
+        printf("[TCP Server status] No response for transaction_id %d !!!\n", expired[i].transaction_id);
+        send_exception(&expired[i].client, expired[i].client_transaction_id,
+                       expired[i].rtu_id, expired[i].address, expired[i].function, EXCEPTION_TARGET_NO_RESPONSE);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (paused_listen_fd[i] >= 0)
+        {
+            struct epoll_event ev = {0};
+            ev.events = EPOLLIN;
+            ev.data.fd = paused_listen_fd[i];
+            epoll_ctl(reactor_epfd, EPOLL_CTL_MOD, paused_listen_fd[i], &ev);
+            paused_listen_fd[i] = -1;
+        }
+    }
+    if (spare_fd < 0)
+    {
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    for (int client_sock = 0; client_sock < MAX_CLIENT_FD; client_sock++)
+    {
+        ClientSession *sess = &sessions[client_sock];
+        if (sess->open && !sess->flush_pending && now - sess->last_active_ms > IDLE_TIMEOUT_MS)
+        {
+            printf("[TCP Server session] Client socket %d idle, closed.\n", client_sock);
+            session_close(client_sock);
+        }
+    }
+}
+
+// ===== thread 1: receive request packet from Cloud, send queued responses (epoll reactor) =====
 void *tcp_receiver_thread(void *arg) // argument
 {
-    sqlite3 *db;
-    sqlite3_open("modbus_mapping.db", &db);
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);  // -----------------------------------
+    int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0); // -----------------------------------
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     struct sockaddr_in addr = {0};                   // Cấu trúc địa chỉ server
     addr.sin_family = AF_INET;                       // AF_INET -> IPv4
     addr.sin_port = htons(PORT);                     // declare TCP port connection
@@ -91,33 +894,104 @@ void *tcp_receiver_thread(void *arg) // argument
     printf("[TCP connect with Cloud] Listening on port %d...\n", PORT); // ------------------------------------
     // write_log_log("write_log.log", "INFO", "[TCP connect with Cloud] Listening on port %d...", PORT);
 
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.data.fd = reactor_wake_fd;
+    epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, reactor_wake_fd, &ev);
+
+    udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    addr.sin_port = htons(UDP_PORT);
+    if (bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        ev.data.fd = udp_fd;
+        epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, udp_fd, &ev);
+        printf("[TCP connect with Cloud] Listening UDP on port %d...\n", UDP_PORT);
+    }
+    else
+    {
+        perror("[TCP connect with Cloud] UDP bind");
+    }
+
+    int tls_listenfd = -1;
+#if USE_TLS
+    if (tls_init() == 0)
+    {
+        tls_listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        setsockopt(tls_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        addr.sin_port = htons(TLS_PORT);
+        bind(tls_listenfd, (struct sockaddr *)&addr, sizeof(addr));
+        listen(tls_listenfd, 5);
+        ev.data.fd = tls_listenfd;
+        epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, tls_listenfd, &ev);
+        printf("[TCP connect with Cloud] Listening TLS on port %d...\n", TLS_PORT);
+    }
+    else
+    {
+        fprintf(stderr, "[TCP connect with Cloud] Can not load %s / %s, TLS port disabled !!!\n", TLS_CERT_FILE, TLS_KEY_FILE);
+    }
+#endif
+
+    struct epoll_event events[MAX_EVENTS];
+    long long last_reap_ms = now_ms();
     while (1)
     {
-        int client_sock = accept(listenfd, NULL, NULL);
-        if (client_sock >= 0)
+        int n = epoll_wait(reactor_epfd, events, MAX_EVENTS, 1000);
+        if (now_ms() - last_reap_ms >= 1000)
         {
-            uint8_t buffer[260];                                      // data buffer
-            int bytes = recv(client_sock, buffer, sizeof(buffer), 0); // receice data packet from Cloud
-            if (bytes >= 12)                                          // default modbus TCP packet length >= 12 bytes
+            session_reap();
+            last_reap_ms = now_ms();
+        }
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listenfd || fd == tls_listenfd)
+            {
+                session_accept(fd, fd == tls_listenfd);
+            }
+            else if (fd == reactor_wake_fd)
+            {
+                uint64_t count;
+                while (read(reactor_wake_fd, &count, sizeof(count)) > 0)
+                {
+                }
+                for (int client_sock = 0; client_sock < MAX_CLIENT_FD; client_sock++)
+                {
+                    if (sessions[client_sock].open && sessions[client_sock].flush_pending)
+                    {
+                        session_flush(client_sock);
+                    }
+                }
+                udp_flush();
+            }
+            else if (fd == udp_fd)
             {
-                printf("[TCP Server receive packet] Received packet from Cloud\n");
-                RequestPacket next_packet;
-                next_packet.transaction_id = (buffer[0] << 8) | buffer[1];
-                next_packet.protocol_id = (buffer[2] << 8) | buffer[3];
-                next_packet.length = (buffer[4] << 8) | buffer[5];
-                next_packet.rtu_id = (buffer[6] << 8) | buffer[7];
-                next_packet.address = (buffer[8] << 8) | buffer[9];
-                next_packet.function = (buffer[10] << 8) | buffer[11];
-                next_packet.quantity = (buffer[12] << 8) | buffer[13];
-                next_packet.client_sock = client_sock;
-                add_queue(next_packet);
-                // write_log_log("write_log.log", "INFO", "Received packet: transaction_id=%d, rtu_id=%d, address=%d, function=%d, quantity=%d",
-                //           next_packet.transaction_id, next_packet.rtu_id, next_packet.address, next_packet.function, next_packet.quantity);
+                if (events[i].events & EPOLLIN)
+                {
+                    udp_read();
+                }
+                if (events[i].events & EPOLLOUT)
+                {
+                    udp_flush();
+                }
             }
             else
             {
-                printf("[TCP Server receive packet] Invalid packet !!!\n");
-                close(client_sock);
+#if USE_TLS
+                if (sessions[fd].open && sessions[fd].handshaking && session_handshake(fd) != 1)
+                {
+                    continue; // handshake still running or failed
+                }
+#endif
+                if (events[i].events & EPOLLOUT)
+                {
+                    session_flush(fd);
+                }
+                if (sessions[fd].open && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                {
+                    session_read(fd);
+                }
             }
         }
     }
@@ -140,30 +1014,79 @@ void *process_request_thread(void *arg)
         if (new_address < 0)
         {
             printf("[TCP Server mapping] Failed to mapping address %d for RTU ID %d\n", packet.address, packet.rtu_id);
+            send_exception(&packet.client, packet.transaction_id, packet.rtu_id, packet.address,
+                           packet.function, EXCEPTION_ILLEGAL_DATA_ADDRESS);
             continue; // skip this request if mapping failed
         }
-        // send request to Redis server
-        char json_packet[256];
-        snprintf(json_packet, sizeof(json_packet),
-                 "{\"transaction_id\":%d, \"protocol_id\":%d, \"length\":%d, \"rtu_id\":%d,\"rtu_address\":%d,\"function\":%d,\"quantity\":%d}",
+        if (packet.function == 23 && packet.data_count >= 1) // write address of read/write multiple
+        {
+            int write_address = lookup_mapped_address(db, packet.rtu_id, packet.data[0]);
+            if (write_address < 0)
+            {
+                send_exception(&packet.client, packet.transaction_id, packet.rtu_id, packet.address,
+                               packet.function, EXCEPTION_ILLEGAL_DATA_ADDRESS);
+                continue;
+            }
+            packet.data[0] = write_address;
+        }
+
+        long long deadline_ms = packet.received_ms + PENDING_TIMEOUT_MS;
+        int remaining_ms = (int)(deadline_ms - now_ms()); // time the RTU server has left for this request
+        if (remaining_ms <= 0)
+        {
+            send_exception(&packet.client, packet.transaction_id, packet.rtu_id, packet.address,
+                           packet.function, EXCEPTION_TARGET_NO_RESPONSE);
+            continue;
+        }
+        pthread_mutex_lock(&pending_mutex); // save socket, is waiting for response from RTU server
+        if (pending_count >= MAX_PENDING)
+        {
+            pthread_mutex_unlock(&pending_mutex);
+            printf("[TCP Server processing] Too many pending requests, transaction ID %d rejected !!!\n", packet.transaction_id);
+            send_exception(&packet.client, packet.transaction_id, packet.rtu_id, packet.address,
+                           packet.function, EXCEPTION_SERVER_BUSY);
+            continue;
+        }
+        int client_transaction_id = packet.transaction_id;
+        packet.transaction_id = next_transaction_id; // unique id for RTU server, clients may reuse their ids
+        next_transaction_id = next_transaction_id % 65535 + 1;
+        pending_responses[pending_count].transaction_id = packet.transaction_id;
+        pending_responses[pending_count].client_transaction_id = client_transaction_id;
+        pending_responses[pending_count].client = packet.client;
+        pending_responses[pending_count].rtu_id = packet.rtu_id;
+        pending_responses[pending_count].address = packet.address;
+        pending_responses[pending_count].function = packet.function;
+        pending_responses[pending_count].deadline_ms = deadline_ms;
+        pending_count++;
+        pthread_mutex_unlock(&pending_mutex);
+
+        // send request to Redis server, write data of FC16 / FC22 / FC23 as "data":[...]
+        char json_packet[256 + 8 * MAX_DATA_WORDS];
+        int json_len = snprintf(json_packet, sizeof(json_packet),
+                 "{\"transaction_id\":%d, \"protocol_id\":%d, \"length\":%d, \"rtu_id\":%d,\"rtu_address\":%d,\"function\":%d,\"quantity\":%d,\"timeout_ms\":%d",
                  packet.transaction_id,
                  packet.protocol_id,
                  packet.length,
                  packet.rtu_id,
                  new_address,
                  packet.function,
-                 packet.quantity);
+                 packet.quantity,
+                 remaining_ms);
+        for (int i = 0; i < packet.data_count; i++)
+        {
+            json_len += snprintf(json_packet + json_len, sizeof(json_packet) - json_len, "%s%d", i ? "," : ",\"data\":[", packet.data[i]);
+        }
+        snprintf(json_packet + json_len, sizeof(json_packet) - json_len, "%s}", packet.data_count ? "]" : "");
 
         printf("[TCP Server send request] Sending request to Redis: %s\n", json_packet);
         // write_log_log("write_log.log", "INFO", "[TCP Server send request] Sending request to Redis: %s", json_packet);
         // write_log_db(db, "INFO", "Sending request to Redis: %s", json_packet);
 
-        redisCommand(redis, "PUBLISH modbus_request %s", json_packet); // send request to Redis channel - modbus_request
-        pthread_mutex_lock(&pending_mutex);                            // save socket, is waiting for response from RTU server
-        pending_responses[pending_count].transaction_id = packet.transaction_id;
-        pending_responses[pending_count].client_sock = packet.client_sock;
-        pending_count++;
-        pthread_mutex_unlock(&pending_mutex);
+        redisReply *reply = redisCommand(redis, "PUBLISH modbus_request %s", json_packet); // send request to Redis channel - modbus_request
+        if (reply)
+        {
+            freeReplyObject(reply);
+        }
     }
 
     redisFree(redis); // clean up Redis connection
@@ -209,11 +1132,11 @@ void *response_listener_thread(void *arg)
                     continue;
                 }
 
-                uint8_t transaction_id = json_integer_value(json_object_get(root, "transaction_id"));
+                int transaction_id = json_integer_value(json_object_get(root, "transaction_id"));
                 uint8_t rtu_id = json_integer_value(json_object_get(root, "rtu_id"));
                 int address = json_integer_value(json_object_get(root, "rtu_address"));
                 int function = json_integer_value(json_object_get(root, "function"));
-                // int status = json_integer_value(json_object_get(root, "status"));
+                int status = json_integer_value(json_object_get(root, "status")); // 0 or Modbus exception code
                 int value = json_integer_value(json_object_get(root, "value"));
 
                 printf("[TCP Server receive response] Received data for transaction_id %d with value %d\n", transaction_id, value);
@@ -222,19 +1145,12 @@ void *response_listener_thread(void *arg)
 
                 pthread_mutex_lock(&pending_mutex);
                 int found = 0;
+                corresponding_address client;
                 for (int i = 0; i < pending_count; ++i)
                 {
                     if (pending_responses[i].transaction_id == transaction_id)
                     {
-                        int client_sock = pending_responses[i].client_sock;
-
-                        uint8_t response[8] = {transaction_id, rtu_id, address, function, (value >> 8) & 0xFF, value & 0xFF, 0, 0};
-                        send(client_sock, response, 8, 0); // feedback response to Cloud server
-                        printf("[TCP Server receive packet] Value response for client have device ID: %d is %d\n", rtu_id, value);
-
-                        printf("\n");
-                        close(client_sock); // close client socket
-
+                        client = pending_responses[i];
                         for (int j = i; j < (pending_count - 1); j++) // delete response from pending_responses
                         {
                             pending_responses[j] = pending_responses[j + 1];
@@ -246,7 +1162,29 @@ void *response_listener_thread(void *arg)
                     }
                 }
                 pthread_mutex_unlock(&pending_mutex);
-                if (!found)
+
+                if (found && status != 0) // device failed, slave exception or circuit breaker open
+                {
+                    if (send_exception(&client.client, client.client_transaction_id, client.rtu_id, client.address, client.function, status) != 0)
+                    {
+                        printf("[TCP Server receive packet] Client of transaction_id %d already disconnected !!!\n", transaction_id);
+                    }
+                    printf("\n");
+                }
+                else if (found) // queue response for reactor, no socket I/O in this thread
+                {
+                    uint8_t response[RESPONSE_SIZE] = {client.client_transaction_id, rtu_id, address, function, (value >> 8) & 0xFF, value & 0xFF, 0, 0};
+                    if (client_send(&client.client, response, RESPONSE_SIZE) == 0) // feedback response to Cloud server
+                    {
+                        printf("[TCP Server receive packet] Value response for client have device ID: %d is %d\n", rtu_id, value);
+                    }
+                    else
+                    {
+                        printf("[TCP Server receive packet] Client of transaction_id %d already disconnected !!!\n", transaction_id);
+                    }
+                    printf("\n");
+                }
+                else
                 {
                     printf("[TCP Server status] Unknown transaction_id: %d\n", transaction_id);
                 }
@@ -259,7 +1197,90 @@ void *response_listener_thread(void *arg)
     return NULL;
 }
 
-// ==== Function: mapping address in SQLite ====
+// ==== Device templates: mapping of devices with a model (device_info.device_model) ====
+// compiled from the template library instead of mapping rows: tag at template address a of the device
+// is tcp address tcp_base_address + a. Adjacent tags are merged into one range. Only used by the
+// processing thread, no lock.
+typedef struct
+{
+    int rtu_id;
+    int tcp_address;
+    int rtu_address;
+    int quantity;
+} MappingBlock;
+
+MappingBlock *mapping_blocks = NULL;
+int mapping_block_count = 0;
+int mapping_data_version = -1; // PRAGMA data_version of last compile
+
+// ==== Function: compile template mapping blocks, again when the database changed ====
+void mapping_blocks_refresh(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &stmt, NULL) == SQLITE_OK)
+    {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            version = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (version == mapping_data_version)
+    {
+        return;
+    }
+    mapping_data_version = version;
+    mapping_block_count = 0;
+
+    // serial slave: only if rtu_route sends its unit_id to its port, the same unit_id on another port is not mapped
+    const char *sql = "SELECT COALESCE(r.rtu_id, s.rtu_id) AS id, COALESCE(d.tcp_base_address, 0) + t.address AS tcp, t.address, "
+                      "CASE WHEN t.data_type IN ('uint32', 'int32', 'float32') THEN 2 ELSE 1 END "
+                      "FROM device_info d JOIN device_template t ON t.model = d.device_model "
+                      "LEFT JOIN rtu_route r ON r.device_id = d.id "
+                      "LEFT JOIN rtu_route s ON s.rtu_id = d.unit_id AND s.port_id = d.port_id AND s.device_id IS NULL "
+                      "WHERE r.rtu_id IS NOT NULL OR s.rtu_id IS NOT NULL ORDER BY id, tcp";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return; // no template tables
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        MappingBlock tag = {sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1),
+                            sqlite3_column_int(stmt, 2), sqlite3_column_int(stmt, 3)};
+        MappingBlock *last = mapping_block_count ? &mapping_blocks[mapping_block_count - 1] : NULL;
+        if (last && last->rtu_id == tag.rtu_id && tag.tcp_address <= last->tcp_address + last->quantity &&
+            tag.tcp_address - last->tcp_address == tag.rtu_address - last->rtu_address)
+        {
+            int end = tag.tcp_address + tag.quantity - last->tcp_address;
+            last->quantity = end > last->quantity ? end : last->quantity;
+            continue;
+        }
+        if (mapping_block_count % 64 == 0)
+        {
+            mapping_blocks = realloc(mapping_blocks, (mapping_block_count + 64) * sizeof(MappingBlock));
+        }
+        mapping_blocks[mapping_block_count++] = tag;
+    }
+    sqlite3_finalize(stmt);
+    printf("[TCP Server mapping] Device templates: %d mapping blocks\n", mapping_block_count);
+}
+
+// ==== Function: mapping address of device template, -1 if none ====
+int lookup_template_address(int rtu_id, int tcp_address)
+{
+    for (int i = 0; i < mapping_block_count; i++)
+    {
+        MappingBlock *block = &mapping_blocks[i];
+        if (block->rtu_id == rtu_id && tcp_address >= block->tcp_address && tcp_address < block->tcp_address + block->quantity)
+        {
+            return block->rtu_address + tcp_address - block->tcp_address;
+        }
+    }
+    return -1;
+}
+
+// ==== Function: mapping address in SQLite, then device templates ====
 int lookup_mapped_address(sqlite3 *db, int rtu_id, int tcp_address)
 {
     int new_address = tcp_address;
@@ -280,7 +1301,6 @@ int lookup_mapped_address(sqlite3 *db, int rtu_id, int tcp_address)
         }
         else
         {
-            printf("[TCP Server mapping] No mapping found for address %d !!!\n", tcp_address);
             new_address = -1;
         }
         sqlite3_finalize(stmt); // clean up SQLite memory
@@ -290,6 +1310,19 @@ int lookup_mapped_address(sqlite3 *db, int rtu_id, int tcp_address)
         printf("[TCP Server mapping] Table don't have columm match !!! \n");
         new_address = -1;
     }
+    if (new_address < 0)
+    {
+        mapping_blocks_refresh(db);
+        new_address = lookup_template_address(rtu_id, tcp_address);
+        if (new_address >= 0)
+        {
+            printf("[TCP Server mapping] Found template mapping: %d -> %d\n", tcp_address, new_address);
+        }
+        else
+        {
+            printf("[TCP Server mapping] No mapping found for address %d !!!\n", tcp_address);
+        }
+    }
 
     return new_address;
 }
@@ -302,6 +1335,9 @@ void get_data_mannual()
 int main()
 {
     pthread_t receive_thread, process_thread, response_thread; // contain ID of threads
+    reactor_epfd = epoll_create1(0);
+    reactor_wake_fd = eventfd(0, EFD_NONBLOCK);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     pthread_create(&receive_thread, NULL, tcp_receiver_thread, NULL);
     pthread_create(&process_thread, NULL, process_request_thread, NULL);
     pthread_create(&response_thread, NULL, response_listener_thread, NULL);